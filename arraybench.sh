@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# arraybench.sh - Shell lab array benchmark
+#
+# Times the array operations of a tsh at growing sizes. For each size N
+# a script is generated that does N appends to an indexed array, N
+# stores into an associative array, N lookups in each, N/2 unsets in
+# each, and prints the final lengths. A baseline script of as many
+# plain assignments is timed too, and subtracted, so what is left is
+# the cost of the array operations themselves. If they are O(1), the
+# time per operation stays flat as N grows.
+#
+# Usage: ./arraybench.sh [shell [n1 n2 ...]]
+#        default: ./arraybench.sh ./tshfast 10000 100000 1000000
+#
+
+shell=${1:-./tshfast}
+[ $# -gt 0 ] && shift
+sizes=${*:-10000 100000 1000000}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+# run script - Run script in the shell, print its output and wall ms
+run() {
+    start=$(date +%s%N)
+    out=$("$shell" "$1") || { echo "$shell $1 failed" >&2; exit 1; }
+    end=$(date +%s%N)
+    echo "$out $(( (end - start) / 1000000 ))"
+}
+
+printf '%10s %10s %10s %12s %10s\n' elements ops total-ms baseline-ms ns/op
+for n in $sizes; do
+    awk -v n="$n" 'BEGIN {
+        print "declare -A m"
+        for (i = 0; i < n; i++) print "a+=(v" i ")"
+        for (i = 0; i < n; i++) print "m[k" i "]=v" i
+        for (i = 0; i < n; i++) print "x=${a[" i "]}"
+        for (i = 0; i < n; i++) print "x=${m[k" i "]}"
+        for (i = 0; i < n; i += 2) print "unset a[" i "]"
+        for (i = 0; i < n; i += 2) print "unset m[k" i "]"
+        print "/bin/echo ${#a[@]} ${#m[@]}"
+    }' > "$dir/array.tsh"
+    awk -v n="$n" 'BEGIN {
+        for (i = 0; i < 5 * n; i++) print "x=v" i
+        print "/bin/echo 0 0"
+    }' > "$dir/base.tsh"
+
+    set -- $(run "$dir/array.tsh")
+    if [ "$1 $2" != "$((n / 2)) $((n / 2))" ]; then
+        echo "$shell: expected $((n / 2)) elements left in each array, got $1 $2" >&2
+        exit 1
+    fi
+    total=$3
+    set -- $(run "$dir/base.tsh")
+    base=$3
+    ops=$((5 * n))
+    printf '%10d %10d %10d %12d %10d\n' "$n" "$ops" "$total" "$base" \
+        $(( (total - base) * 1000000 / ops ))
+done
@@ -39,7 +39,12 @@
   "trace21.txt",\
   "trace22.txt",\
   "trace23.txt",\
-  "trace24.txt"
+  "trace24.txt",\
+  "trace25.txt",\
+  "trace26.txt",\
+  "trace27.txt",\
+  "trace28.txt",\
+  "trace29.txt"
 
 /* Various constants */
 #define ITERS 3
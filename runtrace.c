@@ -18,6 +18,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <time.h>
 #include "config.h"
 
 #define MAXBUF 1024
@@ -34,6 +35,8 @@ char *state;
 /* Modified by command line args */
 int verbose = 0;
 int sandboxing = 0;
+int fast = 0;                /* skip the think time between commands */
+int timeout = DRIVER_TIMEOUT; /* seconds to wait for the shell */
 char *tracefile = NULL;
 char *shellprog = "./tsh";
 char *shellargs = NULL;
@@ -70,12 +73,15 @@ int main(int argc, char **argv)
     FILE *tracefp;
     int n=0; /* keep gcc happy */
     struct stat statbuf;
+    struct timespec delay;
+    long ms;
+    int prompted = 1; /* no command sent since the last prompt */
     
     /* Install the signal handler */
     signal(SIGALRM, sigalrm_handler);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hVxs:f:")) != EOF) {
+    while ((c = getopt(argc, argv, "hVFxs:f:t:")) != EOF) {
         switch (c) {
         case 'h':             /* Print help message */
             usage("");
@@ -89,6 +95,12 @@ int main(int argc, char **argv)
 	case 'f':             /* Trace file name */
 	    tracefile = strdup(optarg);
 	    break;
+	case 'F':             /* Replay as fast as possible */
+	    fast = 1;
+	    break;
+	case 't':             /* Seconds to wait for the shell */
+	    timeout = atoi(optarg);
+	    break;
 	case 'x':             /* Enable sandboxing */
 	    sandboxing = 1;   /* Hidden argument */
 	    break;
@@ -186,7 +198,7 @@ int main(int argc, char **argv)
     close(datafd[1]); 
 
     /* Read the initial prompt from the shell */
-    if (readable(datafd[0], DRIVER_TIMEOUT) == 0) {
+    if (readable(datafd[0], timeout) == 0) {
 	fprintf(stderr, "%s: Runtrace timed out waiting for initial shell prompt\n", tracefile);
         n = n; /* keep gcc happy */
     }     
@@ -227,7 +239,7 @@ int main(int argc, char **argv)
 	
 	/* WAIT command */
 	if (!strcmp(command, "WAIT")) {
-	    if (readable(syncfd[0], DRIVER_TIMEOUT) == 0) {
+	    if (readable(syncfd[0], timeout) == 0) {
 		printf("%s: Runtrace timed out waiting for sync from job\n", 
 		       tracefile);
 		exit(1);
@@ -249,6 +261,25 @@ int main(int argc, char **argv)
 	else if (!strcmp(command, "NEXT")) {
 	    if (next_prompt() == 0) 
 		exit(0);
+	    prompted = 1;
+	    continue;
+	}
+
+	/* 
+	 * DELAY command. A delay after a prompt is the user's think
+	 * time, which fast mode skips; a delay after a command is how
+	 * long its job ran before a signal, which is part of the work.
+	 */
+	else if (!strcmp(command, "DELAY")) {
+	    ms = atol(line + 5);
+	    if (fast && prompted)
+		continue;
+	    delay.tv_sec = ms / 1000;
+	    delay.tv_nsec = (ms % 1000) * 1000000;
+	    while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+		;
+	    if (verbose)
+		printf("runtrace: slept %ld ms\n", ms);
 	    continue;
 	}
 
@@ -296,6 +327,7 @@ int main(int argc, char **argv)
 		perror("send datafd[0]");
 		exit(1);
 	    }
+	    prompted = 0;
 	}
 
     } /* while loop */
@@ -305,7 +337,7 @@ int main(int argc, char **argv)
     send(datafd[0], bufp, 0, 0);
 
     /* Wait for the shell to terminate */
-    alarm(DRIVER_TIMEOUT);
+    alarm(timeout);
     state = "waiting for shell to terminate";
     waitpid(child_pid, NULL, 0);
 
@@ -328,12 +360,15 @@ void clean() {
 void usage(char *msg)
 {
     printf("%s\n", msg);
-    printf("Usage: runtrace -f <file> -s <shellprog> [-hV]\n");
+    printf("Usage: runtrace -f <file> -s <shellprog> [-hVF] [-t <secs>]\n");
     printf("Options:\n");
     printf("  -h            Print this message\n");
     printf("  -s <shell>    Shell program to test (default ./tsh)\n");
     printf("  -f <file>     Trace file\n");
     printf("  -V            Be more verbose\n");
+    printf("  -F            Replay fast, skipping DELAYs after a prompt\n");
+    printf("  -t <secs>     Seconds to wait for the shell (default %d)\n",
+	   DRIVER_TIMEOUT);
 
     exit(0);
 }
@@ -407,7 +442,7 @@ int next_prompt(void)
     int n;
     
     bzero(buf, MAXBUF);
-    if (readable(datafd[0], DRIVER_TIMEOUT) == 0) {
+    if (readable(datafd[0], timeout) == 0) {
 	printf("%s: Runtrace timed out waiting for next shell prompt\n", 
 	       tracefile);
 	print_child_status();
@@ -427,7 +462,7 @@ int next_prompt(void)
 	printf("%s", buf);
 
 	bzero(buf, MAXBUF);
-	if (readable(datafd[0], DRIVER_TIMEOUT) == 0) {
+	if (readable(datafd[0], timeout) == 0) {
 	    printf("%s: Runtrace timed out waiting for next shell prompt\n", 
 		   tracefile);
 	    print_child_status();
@@ -2,9 +2,22 @@
  * tsh - A tiny shell program with job control
  * This is a shell with basic functions. It can run programs
  * foreground or background, and typing ctrl-c or ctrl-z can
- * send signal to it. Besides, it has 3 built-in commands:
- * jobs, fg job and bg job. I/O redirection is also supported.
+ * send signal to it. Besides, it has built-in commands quit,
+ * jobs, fg job, bg job and let expr. I/O redirection, pipelines,
+ * variables, parameter expansion and $((expr)) arithmetic expansion
+ * are also supported. With maxjobs set, extra background jobs wait
+ * in a queue and start longest-expected-first. Pools shared by all
+ * shells on the host limit how many jobs run at once host-wide.
+ * every and at run commands periodically or after a delay. reclaim
+ * pages out the memory of jobs left stopped. With the freezer option
+ * each job gets a cgroup, and ctrl-z freezes the whole cgroup.
+ * tsh script [args] runs a script, and a command that is a tsh script
+ * runs in the forked child without a new exec of tsh. Words expand
+ * {a,b} and {1..n..step} braces, lazily when filling an array. time
+ * reports a job's run time and hardware performance counters. Commands
+ * are looked up in PATH through a table all shells on the host share.
  */
+#define _GNU_SOURCE        /* for memfd_create and pipe2 */
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,28 +33,73 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <stdint.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
 #define MAXJOBS      16   /* max jobs at any point in time */
 #define MAXJID    1<<16   /* max job ID */
+#define MAXVARS      64   /* max shell variables */
+#define MAXNAME      64   /* max variable name length */
+#define MAXCODE     256   /* max instructions in a compiled expression */
+#define ARITHCACHE   32   /* number of compiled expressions kept around */
+#define MAXPAT      128   /* max items in a compiled pattern */
+#define PATCACHE     16   /* number of compiled patterns kept around */
+#define MAXARRAYS    32   /* max array variables */
+#define MAXINDEX (1 << 24) /* max subscript of an indexed array, plus 1 */
+#define MAXSTAGES    16   /* max commands in a pipeline */
+#define MAXSTATS   1024   /* max commands with runtime statistics */
+#define MAXCMDNAME   32   /* max length of a normalized command name */
+#define MAXPOOLS     16   /* max host-wide job pools */
+#define MAXSLOTS     64   /* max slots in a pool */
+#define POOLCHECK_MS 1000 /* how often waiters look for slots of dead shells */
+#define JSONBUF     512   /* JSON writer buffer size */
+#define MAXTIMERS    16   /* max every and at timers */
+#define MAXSCRIPTS   32   /* files script_lookup remembers */
+#define MAXBRACES     8   /* max brace groups in a word */
+#define ARGBUF     8192   /* bytes of words brace expansion may add */
+#define NPERF         5   /* performance counters per process */
+#define MAXPATHDIRS  64   /* max PATH directories the PATH cache holds */
+#define PATHCHECK_MS 1000 /* how often to check PATH directory mtimes */
+#define TICK_MS      10   /* timer wheel resolution */
+#define WHEEL_BITS    6   /* a wheel level has 1 << WHEEL_BITS slots */
+#define WHEEL_LEVELS  4   /* so timers reach 10ms * 2^24, about 46 hours */
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
 
 /* Job states */
 #define UNDEF         0   /* undefined */
 #define FG            1   /* running in foreground */
 #define BG            2   /* running in background */
 #define ST            3   /* stopped */
+#define QU            4   /* queued, waiting for a free job slot */
 
 /* 
- * Jobs states: FG (foreground), BG (background), ST (stopped)
+ * Jobs states: FG (foreground), BG (background), ST (stopped),
+ * QU (queued)
  * Job state transitions and enabling actions:
  *     FG -> ST  : ctrl-z
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
- * At most 1 job can be in the FG state.
+ *     QU -> BG  : another job ends and this one is dispatched
+ *     QU -> FG  : fg command
+ * At most 1 job can be in the FG state. A BG job is started in the
+ * QU state when maxjobs jobs are already running.
  */
 
 /* Parsing states */
@@ -61,18 +119,170 @@ char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
 int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
+int pipelines = 0;          /* if true, '|' separates pipeline stages */
+int json = 0;               /* if true, report in JSON lines */
+int jsonfd = -1;            /* fd for JSON alongside the usual output, or -1 */
+int freezer = 0;            /* if true, each job runs in its own cgroup */
+int perfcount = 0;          /* if true, every job gets performance counters */
+
+int freezer_open(void);
+
+struct shopt_t {            /* A shell option, set with -o or set -o */
+    char *name;             /* option name */
+    int *flag;              /* the variable it controls */
+    int (*enable)(void);    /* called before it is turned on, or NULL */
+};
+struct shopt_t shopts[] = {
+    {"pipeline", &pipelines, NULL},
+    {"json", &json, NULL},
+    {"freezer", &freezer, freezer_open},
+    {"perf", &perfcount, NULL},
+    {NULL, NULL, NULL}
+};
+
+/* 
+ * With the perf option, or under time, each process of a job gets
+ * perf_event_open counters with inherit set, so that they count the
+ * whole tree below it too. The parent opens them after fork while the
+ * child waits on a pipe before exec, and the SIGCHLD handler reads and
+ * closes them when it reaps the process.
+ */
+enum perfctr_t { PC_TASKCLOCK, PC_INSTRUCTIONS, PC_CYCLES, PC_CACHEMISSES, PC_BRANCHMISSES };
+
+struct runstats_t {         /* What a job used */
+    long long count[NPERF]; /* counter values, -1 if not counted */
+    long utime_us;          /* user CPU time of the reaped processes */
+    long stime_us;          /* system CPU time of the reaped processes */
+    long real_ms;           /* wall time, once it ended */
+};
 
 struct job_t {              /* The job struct */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID, also its process group ID */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
     char cmdline[MAXLINE];  /* command line */
+    int nprocs;             /* processes in the job, one per external stage */
+    int nlive;              /* processes not yet reaped */
+    pid_t pids[MAXSTAGES];  /* their PIDs, 0 once reaped; pids[0] == pid */
+    int laststage;          /* pids index of the last stage, -1 for a builtin */
+    int termsig;            /* signal that killed the last stage, or 0 */
+    int exitstatus;         /* exit status of the last stage */
+    long start_ms;          /* when the job started running */
+    int stopped;            /* true if the job was ever stopped */
+    int holdfd;             /* QU: closing it lets the job exec, else -1 */
+    unsigned long statkey;  /* runtime statistics key of the command */
+    unsigned long namekey;  /* the same, ignoring the arguments */
+    char cmdname[MAXCMDNAME]; /* normalized argv[0] */
+    long expect_ms;         /* QU: expected run time when queued, or -1 */
+    int qstate;             /* QU: FG or BG, the state once dispatched */
+    int pool;               /* host-wide pool the job needs, or -1 */
+    int poolslot;           /* slot it holds in that pool, or -1 */
+    long stop_ms;           /* when the job last stopped */
+    long reclaim_ms;        /* stop_ms of the stop already reclaimed, or 0 */
+    int cgid;               /* its cgroup under freezerfd, or 0 */
+    int eventsfd;           /* that cgroup's cgroup.events, or -1 */
+    int freezing;           /* a freeze was asked for but not yet seen */
+    int perffd[MAXSTAGES][NPERF]; /* counters of each process, -1 if none */
+    struct runstats_t run;  /* what the reaped processes used */
 };
 struct job_t job_list[MAXJOBS]; /* The job list */
 
+struct var_t {              /* The shell variable struct */
+    char name[MAXNAME];     /* variable name, empty if the slot is free */
+    char value[MAXLINE];    /* variable value */
+};
+struct var_t var_list[MAXVARS]; /* The shell variables */
+
+/* Array kinds */
+#define ARR_INDEXED   1   /* indexed by integers, stored as a dense vector */
+#define ARR_ASSOC     2   /* indexed by strings, stored in a hash table */
+
+/* 
+ * An expanded "${name[@]}" is replaced by ARR_MARKER, 'v' (values) or
+ * 'k' (keys), and the index of the array in array_list. parseline then
+ * copies the element pointers straight into argv.
+ */
+#define ARR_MARKER '\001'
+
+/* 
+ * A character that came out of an expansion and that parsetokens would
+ * take for syntax (a quote, a redirection, '|', '&' or a brace) is put
+ * after EXP_LITERAL, so that a value is never parsed as part of the
+ * command line. White-space is left alone: unquoted values still split.
+ */
+#define EXP_LITERAL '\002'
+#define EXP_SPECIAL "'\"<>|&{},\001\002"
+int expand_protect;         /* expand_value marks syntax characters */
+
+struct array_t {            /* The array variable struct */
+    char name[MAXNAME];     /* array name, empty if the slot is free */
+    int kind;               /* ARR_INDEXED or ARR_ASSOC */
+    size_t count;           /* number of set elements */
+    size_t len;             /* ARR_INDEXED: highest set index + 1 */
+    size_t cap;             /* allocated elems or slots */
+    char **elems;           /* ARR_INDEXED: elements, NULL if unset */
+    struct arr_slot {       /* ARR_ASSOC: open addressing, linear probing */
+        char *key;          /* NULL if empty, arr_tombstone if deleted */
+        char *value;
+    } *slots;
+    size_t used;            /* ARR_ASSOC: slots that are not empty */
+};
+struct array_t array_list[MAXARRAYS]; /* The array variables */
+char arr_tombstone[1];      /* key of a deleted hash table slot */
+
+/* 
+ * Arithmetic expressions are compiled once into a small stack machine
+ * program and kept in arith_cache, indexed by a hash of their text, so
+ * that evaluating the same expression again skips the parser.
+ */
+enum arith_op_t {
+    OP_NUM,  OP_LOAD, OP_STORE, OP_POP,  OP_JZ,   OP_JNZ,  OP_JMP,
+    OP_BOOL, OP_NEG,  OP_NOT,   OP_BNOT, OP_MUL,  OP_DIV,  OP_MOD,
+    OP_ADD,  OP_SUB,  OP_SHL,   OP_SHR,  OP_LT,   OP_LE,   OP_GT,
+    OP_GE,   OP_EQ,   OP_NE,    OP_BAND, OP_BXOR, OP_BOR
+};
+
+struct arith_insn {
+    int op;                 /* one of arith_op_t */
+    long long arg;          /* literal, jump target or offset into names */
+};
+
+struct arith_code {
+    char src[MAXLINE];      /* expression text, empty if the slot is free */
+    int ninsns;             /* number of instructions */
+    struct arith_insn insns[MAXCODE];
+    int namelen;            /* bytes used in names */
+    char names[MAXLINE];    /* NUL-terminated variable names */
+};
+struct arith_code arith_cache[ARITHCACHE]; /* Compiled expressions */
+
+/* Shell patterns, compiled so that matching never re-parses them */
+#define PAT_CHAR      0   /* a literal character */
+#define PAT_ANY       1   /* ? */
+#define PAT_STAR      2   /* * */
+#define PAT_SET       3   /* [...] */
+
+struct pattern_t {
+    int n;                  /* number of items */
+    struct pat_item {
+        int type;           /* PAT_CHAR, PAT_ANY, PAT_STAR or PAT_SET */
+        unsigned char c;    /* the character for PAT_CHAR */
+        unsigned char set[32]; /* bitmap of characters for PAT_SET */
+    } items[MAXPAT];
+};
+
+struct pattern_code {       /* A compiled pattern and its text */
+    char src[MAXLINE];      /* pattern text, empty if the slot is free */
+    struct pattern_t pat;
+};
+struct pattern_code pattern_cache[PATCACHE]; /* Like arith_cache */
+
 struct cmdline_tokens {
     int argc;               /* Number of arguments */
     char *argv[MAXARGS];    /* The arguments list */
+    char lazy[MAXARGS];     /* argv[i] has braces left for its consumer */
+    char *lit[MAXARGS];     /* and then which of its bytes are quoted, or NULL */
+    int timed;              /* the command was prefixed with time */
     char *infile;           /* The input file */
     char *outfile;          /* The output file */
     enum builtins_t {       /* Indicates if argv[0] is a builtin command */
@@ -80,7 +290,270 @@ struct cmdline_tokens {
         BUILTIN_QUIT,
         BUILTIN_JOBS,
         BUILTIN_BG,
-        BUILTIN_FG} builtins;
+        BUILTIN_FG,
+        BUILTIN_LET,
+        BUILTIN_DECLARE,
+        BUILTIN_UNSET,
+        BUILTIN_SET,
+        BUILTIN_MAXJOBS,
+        BUILTIN_STATS,
+        BUILTIN_POOLS,
+        BUILTIN_EVERY,
+        BUILTIN_AT,
+        BUILTIN_RECLAIM} builtins;
+};
+
+/* 
+ * Runtime statistics of finished jobs, used to dispatch queued jobs
+ * longest-expected-first. They live in a file mapped with MAP_SHARED,
+ * so the SIGCHLD handler updates the persistent copy directly and
+ * concurrent shells share what they learn. Each entry is guarded by a
+ * sequence count: a writer makes it odd with a CAS, rewrites the entry
+ * and makes it even again; readers retry or skip an entry that was
+ * odd or changed while they copied it.
+ */
+#define STATS_MAGIC "tshstat2"
+
+struct cmdstat_t {          /* Runtime statistics of one command */
+    unsigned int seq;       /* odd while a shell rewrites the entry */
+    unsigned long key;      /* hash of name and arguments, 0 if free */
+    unsigned long namekey;  /* hash of the name alone */
+    char name[MAXCMDNAME];  /* normalized argv[0] */
+    unsigned int runs;      /* number of completed runs */
+    unsigned int mean_ms;   /* average wall time, recent runs weigh more */
+};
+
+struct statsfile_t {        /* Layout of the statistics file */
+    char magic[8];          /* STATS_MAGIC */
+    struct cmdstat_t stats[MAXSTATS];
+};
+struct statsfile_t *statsfile; /* The runtime statistics */
+int maxjobs = 0;            /* max running jobs, 0 for no limit */
+
+/* 
+ * Host-wide job pools. Every shell maps the same file with MAP_SHARED;
+ * a job holds a slot of its pool from dispatch until it is reaped.
+ * Slots are taken and given back with compare-and-swap, so no lock is
+ * ever held and the SIGCHLD handler can release them. Giving one back
+ * bumps a futex word and wakes its waiters: a thread in each shell with
+ * a job waiting sleeps on it and signals the shell to try again. A slot
+ * whose job and shell are both gone is free again, which recovers
+ * slots held by a shell that crashed; the start times kept with the
+ * PIDs tell them from later processes that reuse those PIDs.
+ */
+#define POOLS_MAGIC "tshpool2"
+
+struct poolslot_t {         /* One slot of a pool */
+    pid_t job;              /* process group holding it, 0 if free */
+    pid_t shell;            /* shell that started the job */
+    unsigned long long job_start;   /* start time of the job's leader */
+    unsigned long long shell_start; /* and of the shell, 0 if unknown */
+};
+
+struct pool_t {             /* A named counting semaphore */
+    char name[MAXNAME];     /* pool name, empty if unused */
+    int limit;              /* slots [0, limit) may be taken */
+    struct poolslot_t slot[MAXSLOTS];
+};
+
+struct poolfile_t {         /* Layout of the pools file */
+    char magic[8];          /* POOLS_MAGIC */
+    unsigned int released;  /* futex: bumped when a slot may be free */
+    struct pool_t pool[MAXPOOLS];
+};
+struct poolfile_t *poolfile; /* The pools, NULL until first used */
+unsigned long long shell_start; /* this shell's start time, for its slots */
+unsigned int pool_seen;     /* released when dispatch_jobs last found none */
+unsigned int pool_waiting;  /* futex: a job waits, pool_waker is to watch */
+int poolsfd = -1;           /* the pools file, locked to change pools */
+int curpool = -1;           /* pool new jobs go into, or -1 */
+
+/* 
+ * Host-wide PATH cache: a hash table of the executables in the PATH
+ * directories, in a file under $TSH_PATHCACHE (default /dev/shm) named
+ * after the user and a hash of PATH. Every shell maps it read-only. It
+ * is never changed in place; a shell that finds it missing, corrupt or
+ * stale (a directory mtime differs) scans PATH, writes a new file and
+ * renames it over the old one, so shells still mapping the old one
+ * keep a consistent copy. Only the shell's own PATH gets a cache; a
+ * PATH=... word before a command is searched as is.
+ */
+#define PATHC_MAGIC "tshpath1"
+#define PATHC_VERSION 1
+
+struct pathdir_t {          /* A PATH directory as it was scanned */
+    long mtime_sec;         /* its mtime, -1 if it did not exist */
+    long mtime_nsec;
+    unsigned int name;      /* its path, a string offset */
+    unsigned int len;       /* strlen of the path */
+};
+
+struct pathent_t {          /* A bucket of the hash table */
+    unsigned int hash;      /* low bits of the FNV-1a hash of the name */
+    unsigned int name;      /* the command name, a string offset, 0 if free */
+    unsigned int dir;       /* index of the directory it is in */
+};
+
+struct pathcache_t {        /* Header of the PATH cache file */
+    char magic[8];          /* PATHC_MAGIC */
+    unsigned int version;   /* PATHC_VERSION */
+    unsigned int ndirs;     /* followed by ndirs struct pathdir_t */
+    unsigned int nbuckets;  /* then nbuckets struct pathent_t, a power of 2 */
+    unsigned int nents;     /* commands in the table */
+    unsigned long size;     /* of the whole file, a multiple of 8 */
+    unsigned long pathhash; /* FNV-1a hash of PATH */
+    unsigned long strings;  /* file offset of the strings; PATH is first */
+    unsigned long checksum; /* of the file after the header */
+};
+struct pathcache_t *pathcache; /* The mapped PATH cache, or NULL */
+long pathcache_checked;     /* when its directories were last stat'ed */
+
+/* 
+ * With -r file, the session is recorded as a runtrace trace: each input
+ * line, each signal forwarded to a job, and DELAY ms directives with
+ * the time since the previous event.
+ */
+int recordfd = -1;          /* the trace being recorded, or -1 */
+long record_ms;             /* time of the last recorded event */
+
+struct wordbuf_t {          /* Room for the words of brace expansion */
+    size_t len;             /* bytes used */
+    char buf[ARGBUF];
+};
+
+struct pipeline_t {         /* A parsed command line */
+    int nstages;            /* Number of commands */
+    struct cmdline_tokens stage[MAXSTAGES]; /* The commands, left to right */
+    char buf[MAXLINE];      /* Holds the tokens */
+    struct wordbuf_t words; /* Holds the words brace expansion made */
+};
+
+/* 
+ * Brace expansion runs as a generator: brace_init finds the groups of
+ * a word, and each brace_next call writes the next word, stepping the
+ * groups like an odometer with the last one fastest. Nothing but the
+ * current word is ever built. An ordinary command keeps each word in
+ * argv and stops at the first one past MAXARGS or ARGBUF; only
+ * name=(...) takes every word, appending them one at a time. Quoted
+ * braces and commas are text, the rest of the word still expands.
+ */
+struct brace_t {            /* A word being brace expanded */
+    const char *word;       /* the word */
+    const char *lit;        /* per byte of word, true if quoted; or NULL */
+    int ngroups;            /* number of groups */
+    int done;               /* true once every word was made */
+    struct brace_group_t {  /* A {a,b,c} or {x..y..step} group */
+        const char *open;   /* its '{' in word */
+        const char *close;  /* its '}' */
+        int seq;            /* true for a sequence */
+        int letters;        /* sequence of letters, not numbers */
+        int width;          /* zero-pad numbers to width, or 0 */
+        long first;         /* sequence: first value */
+        long step;          /* sequence: signed step */
+        unsigned long count; /* number of items */
+        unsigned long at;   /* item of the current word */
+    } group[MAXBRACES];
+};
+
+/* What a timer does when its last run is still going */
+#define OVL_SKIP      0   /* skip this run */
+#define OVL_QUEUE     1   /* run once the last run ends */
+#define OVL_KILL      2   /* kill the last run and start a new one */
+
+struct wtimer_t {           /* A timer of every or at */
+    int used;               /* true if the entry is in use */
+    int id;                 /* timer ID [1, MAXTIMERS] */
+    int policy;             /* OVL_SKIP, OVL_QUEUE or OVL_KILL */
+    unsigned long expires;  /* tick it fires next */
+    unsigned long interval; /* every: period in ticks; at: 0 */
+    pid_t pgid;             /* job of the last run, or 0 */
+    int pending;            /* OVL_QUEUE: a run waits for the last one */
+    int runs;               /* runs started */
+    int skipped;            /* runs skipped */
+    char cmdline[MAXLINE];  /* command, run as a background job */
+    struct wtimer_t *next;  /* next timer in the same wheel slot */
+    struct wtimer_t **pprev; /* what points to this one, NULL if off the wheel */
+};
+struct wtimer_t timer_list[MAXTIMERS]; /* The timers */
+struct wtimer_t *wheel[WHEEL_LEVELS][WHEEL_SIZE]; /* The timer wheel */
+unsigned long wheel_tick;   /* last tick the wheel has processed */
+long wheel_base;            /* now_ms() at tick 0 */
+int timerfd = -1;           /* fires at the next tick with work, or -1 */
+pid_t lastbg;               /* process group of the last background job */
+
+/* 
+ * With reclaim set, the anonymous memory of a job that stays stopped
+ * for the grace period is paged out with process_madvise. A helper
+ * process does the work, so the prompt never waits for it, and adds
+ * how much the job's RSS shrank to the job's entry in reclaim_stats.
+ */
+struct reclaim_t {          /* Memory reclaimed from a job */
+    pid_t pgid;             /* the job, or 0 */
+    long bytes;             /* anonymous RSS given back */
+    int err;                /* errno of the last failure, or 0 */
+};
+struct reclaim_t *reclaim_stats; /* MAP_SHARED, indexed like job_list */
+long reclaim_grace = -1;    /* ms a job stays stopped first, -1 if off */
+int reclaim_advice = MADV_PAGEOUT; /* or MADV_COLD */
+volatile sig_atomic_t reclaim_due; /* a job stopped since the last look */
+struct wtimer_t reclaim_timer; /* fires as the next grace period ends */
+
+/* 
+ * With the freezer option, every job runs in a cgroup of its own under
+ * tsh.PID, next to the shell's cgroup. ctrl-z writes 1 to the job's
+ * cgroup.freeze, which stops every process of the job, including ones
+ * that catch SIGTSTP or left the process group. The job stays in the
+ * foreground until cgroup.events reports it frozen.
+ */
+int freezerfd = -1;         /* directory of tsh.PID, or -1 */
+char freezer_dir[2 * MAXLINE + 32]; /* its path */
+int freezer_seq;            /* name of the last cgroup made */
+
+/* 
+ * A command that is a tsh script, whose #! line names this very tsh
+ * binary with no argument, is not handed to execve: the forked child
+ * resets itself to the state of a new tsh and reads the script. It
+ * keeps the handlers, the mapped files and the compiled expressions it
+ * already has. Whether a file is such a script is remembered by inode
+ * and mtime, so an unchanged file is only stat'ed.
+ */
+struct script_t {           /* What script_lookup learned about a file */
+    char path[MAXLINE];     /* the command as written, empty if unused */
+    dev_t dev;              /* the file when it was read */
+    ino_t ino;
+    struct timespec mtime;
+    int tsh;                /* true if it is a tsh script */
+};
+struct script_t script_list[MAXSCRIPTS]; /* The files looked at */
+
+struct perfdef_t {          /* A performance counter */
+    const char *name;       /* as time prints it */
+    const char *key;        /* as JSON names it */
+    __u32 type;             /* perf_event_attr type and config */
+    __u64 config;
+};
+const struct perfdef_t perfdefs[NPERF] = {
+    {"task-clock", "task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"instructions", "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cycles", "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"cache-misses", "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch-misses", "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+int perf_denied;            /* perf_event_open is not allowed: stop trying */
+int perf_absent;            /* bit k: this machine has no counter k */
+struct runstats_t lastrun;  /* what the last job to end used */
+pid_t lastrun_pgid;         /* and which job that was */
+int script_next;            /* entry to reuse next */
+int inputfd = STDIN_FILENO; /* where commands are read from */
+
+struct jw_t {               /* A JSON line being written */
+    int fd;                 /* where it goes */
+    size_t n;               /* bytes in buf */
+    int members;            /* members written so far */
+    int trim;               /* if true, drop a trailing newline of strings */
+    int held;               /* a newline is held back */
+    sigset_t prev;          /* signal mask to restore at the end */
+    char buf[JSONBUF];
 };
 
 /* End global variables */
@@ -91,6 +564,7 @@ void eval(char *cmdline);
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
+void sigalrm_handler(int sig);
 
 /* Function from csapp.c */
 void Sigfillset(sigset_t *set);
@@ -105,15 +579,45 @@ void Setpgid(pid_t pid, pid_t pgid);
 int Open(const char *pathname, int flags, mode_t mode);
 void Close(int fd);
 void Sio_error(char s[]);
+void *Malloc(size_t size);
+void *Realloc(void *ptr, size_t size);
+void *Calloc(size_t nmemb, size_t size);
 
 /* My helper functions */
-int builtin_command(struct cmdline_tokens *tok);
+int builtin_command(struct cmdline_tokens *tok, int output_fd);
+void child_exec(struct cmdline_tokens *tok, const char *prog, int script);
 void execute_quit();
 void execute_fg(struct cmdline_tokens *tok, sigset_t *pprev);
 void execute_bg(struct cmdline_tokens *tok);
+void execute_let(struct cmdline_tokens *tok);
+void execute_declare(struct cmdline_tokens *tok);
+void execute_unset(struct cmdline_tokens *tok);
+void execute_set(struct cmdline_tokens *tok, int output_fd);
+void execute_maxjobs(struct cmdline_tokens *tok, int output_fd);
+void execute_stats(struct cmdline_tokens *tok, int output_fd);
+void execute_pools(struct cmdline_tokens *tok, int output_fd);
+void execute_timer(struct cmdline_tokens *tok);
+void execute_reclaim(struct cmdline_tokens *tok, int output_fd);
+int setoption(const char *name, int value);
+int isassign(const char *word);
+int isarrayassign(const char *word);
+int assign(char *word);
+int assign_array(struct cmdline_tokens *tok);
+int expandline(const char *cmdline, char *expanded);
+int expand_text(const char *p, const char *stop, char **outp, char *end);
+const char *expand_arith(const char *p, const char *stop, char **outp, char *end);
+const char *expand_param(const char *p, const char *stop, char **outp, char *end,
+                         int alone);
+const char *expand_array(const char *name, int what, int alone, const char *close,
+                         const char *stop, char **outp, char *end);
 
 /* Here are helper routines that we've provided for you */
 int parseline(const char *cmdline, struct cmdline_tokens *tok); 
+int parsetokens(char *buf, struct cmdline_tokens *tok, struct wordbuf_t *words);
+int brace_init(struct brace_t *b, const char *word, const char *lit);
+int brace_next(struct brace_t *b, char *out, size_t size);
+unsigned long brace_count(struct brace_t *b);
+int parsepipeline(const char *cmdline, struct pipeline_t *pl);
 
 void sigquit_handler(int sig);
 
@@ -124,15 +628,105 @@ int addjob(struct job_t *job_list, pid_t pid, int state, char *cmdline);
 int deletejob(struct job_t *job_list, pid_t pid); 
 pid_t fgpid(struct job_t *job_list);
 struct job_t *getjobpid(struct job_t *job_list, pid_t pid);
+struct job_t *getjobproc(struct job_t *job_list, pid_t pid);
 struct job_t *getjobjid(struct job_t *job_list, int jid); 
 int pid2jid(pid_t pid); 
 void listjobs(struct job_t *job_list, int output_fd);
+void listjob(struct job_t *job, int i, int output_fd);
+void listjobs_long(struct job_t *job_list, int output_fd);
+
+long now_ms(void);
+void stats_open(void);
+void stats_setkey(struct job_t *job, struct pipeline_t *pl);
+int stats_read(struct cmdstat_t *st, struct cmdstat_t *copy);
+void stats_record(struct job_t *job);
+long stats_predict(struct job_t *job);
+int running_jobs(void);
+void release_job(struct job_t *job);
+void dispatch_jobs(void);
+int pools_open(void);
+int pool_find(const char *name, int create);
+int pool_acquire(struct job_t *job);
+void pool_release(struct job_t *job);
+int pool_holder_dead(struct poolslot_t *slot);
+void pool_wake(void);
+const char *resolve_command(struct cmdline_tokens *tok, char *buf);
+int pathc_cacheable(const char *path);
+int pathc_attach(const char *path);
+int pathc_fresh(void);
+int pathc_build(const char *path);
+int pathc_refresh(const char *path);
+const char *pathc_lookup(const char *name, char *buf);
+void record_open(const char *path);
+int record_line(const char *cmdline);
+void record_event(const char *event, int delay);
+void jw_begin(struct jw_t *w, int fd, const char *type);
+void jw_str(struct jw_t *w, const char *key, const char *value);
+void jw_int(struct jw_t *w, const char *key, long value);
+void jw_end(struct jw_t *w);
+int json_fd(int fd);
+int human(void);
+const char *state_name(int state);
+void notice(const char *type, struct job_t *job, const char *key, long value);
+void report_error(char *s, ...);
+void timers_run(void);
+struct wtimer_t *timer_add(long delay, long interval, int policy, const char *cmdline);
+void timer_cancel(struct wtimer_t *t);
+long timer_next_ms(struct wtimer_t *t);
+int timer_list_idle(void);
+void wait_signal(const sigset_t *mask);
+char *readline_wait(char *cmdline);
+void listtimers(int output_fd);
+void reclaim_run(void);
+int freezer_newgroup(void);
+void freezer_close(void);
+int freezer_join(int cgid, pid_t pid);
+int freezer_write(struct job_t *job, int frozen);
+int freezer_fds(struct pollfd *pfd);
+void freezer_run(void);
+void job_resume(struct job_t *job);
+void perf_open(pid_t pid, int fd[NPERF]);
+void perf_reap(struct job_t *job, int i, struct rusage *ru);
+int job_runstats(struct job_t *job, struct runstats_t *r);
+void runstats_print(struct runstats_t *r, int fd, const char *indent, int times);
+void runstats_json(struct jw_t *w, struct runstats_t *r, int times);
+void time_report(struct runstats_t *r, const char *cmdline);
+struct script_t *script_lookup(const char *cmd);
+int script_open(int argc, char **argv);
+void script_exec(int argc, char **argv);
+void shell_loop(int emit_prompt);
+void init_signals(void);
+void listjobs_json(struct job_t *job_list, int fd, int detail);
+
+struct var_t *getvarent(const char *name);
+char *getvar(const char *name);
+int setvar(const char *name, const char *value);
+void unsetvar(const char *name);
+
+struct array_t *getarray(const char *name);
+struct array_t *newarray(const char *name, int kind);
+void cleararray(struct array_t *arr);
+void deletearray(struct array_t *arr);
+int array_lookup(struct array_t *arr, const char *sub, char **value);
+int array_set(struct array_t *arr, const char *sub, const char *value);
+int array_append(struct array_t *arr, const char *value);
+int array_unset(struct array_t *arr, const char *sub);
+char *array_next(struct array_t *arr, size_t *pos, char **key);
+
+struct arith_code *arith_compile(const char *expr);
+int arith_run(struct arith_code *code, long long *result);
+int arith_eval(const char *expr, long long *result);
+
+int pattern_compile(struct pattern_t *pat, const char *src);
+const struct pattern_t *pattern_cached(const char *src);
+int pattern_match(const struct pattern_t *pat, const char *s, size_t len);
 
 void usage(void);
 void unix_error(char *msg);
 void app_error(char *msg);
 ssize_t sio_puts(char s[]);
 ssize_t sio_putl(long v);
+static void sio_ltoa(long v, char s[], int b);
 void sio_error(char s[]);
 
 
@@ -146,8 +740,7 @@ handler_t *Signal(int signum, handler_t *handler);
 int 
 main(int argc, char **argv) 
 {
-    char c;
-    char cmdline[MAXLINE];    /* cmdline for fgets */
+    char c, *path;
     int emit_prompt = 1; /* emit prompt (default) */
 
     /* Redirect stderr to stdout (so that driver will get all output
@@ -155,7 +748,7 @@ main(int argc, char **argv)
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvpo:r:Jj:")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -166,38 +759,79 @@ main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
             break;
+        case 'o':             /* turn on a shell option */
+            if (setoption(optarg, 1) < 0)
+                usage();
+            break;
+        case 'J':             /* report in JSON lines */
+            json = 1;
+            break;
+        case 'j':             /* JSON lines to a separate fd */
+            json = 1;
+            jsonfd = atoi(optarg);
+            if (fcntl(jsonfd, F_GETFD) < 0)
+                usage();
+            break;
+        case 'r':             /* record the session as a trace */
+            record_open(optarg);
+            break;
         default:
             usage();
         }
     }
 
+    /* tsh script [args] reads its commands from script */
+    if (optind < argc) {
+        emit_prompt = 0;
+        if (script_open(argc - optind, argv + optind) < 0)
+            exit(1);
+    }
+
     /* Install the signal handlers */
+    init_signals();
+
+    /* Initialize the job list */
+    initjobs(job_list);
+    stats_open();
+    if ((path = getenv("PATH")) != NULL && pathc_cacheable(path))
+        pathc_attach(path);  /* Checked for freshness when first used */
+
+    /* Execute the shell's read/eval loop */
+    shell_loop(emit_prompt);
+}
 
+/* init_signals - Install the signal handlers */
+void 
+init_signals(void) 
+{
     /* These are the ones you will need to implement */
     Signal(SIGINT,  sigint_handler);   /* ctrl-c */
     Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
     Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+    Signal(SIGALRM, sigalrm_handler);  /* Retry jobs waiting for a pool */
     Signal(SIGTTIN, SIG_IGN);
     Signal(SIGTTOU, SIG_IGN);
 
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler); 
+}
 
-    /* Initialize the job list */
-    initjobs(job_list);
+/* shell_loop - The read/eval loop. Never returns. */
+void 
+shell_loop(int emit_prompt) 
+{
+    char cmdline[MAXLINE];    /* cmdline for fgets */
 
-    /* Execute the shell's read/eval loop */
     while (1) {
 
         if (emit_prompt) {
             printf("%s", prompt);
             fflush(stdout);
         }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin)) { 
+        if (readline_wait(cmdline) == NULL) { 
             /* End of file (ctrl-d) */
-            printf ("\n");
+            if (inputfd == STDIN_FILENO)
+                printf ("\n");
             fflush(stdout);
             fflush(stderr);
             exit(0);
@@ -205,9 +839,18 @@ main(int argc, char **argv)
         
         /* Remove the trailing newline */
         cmdline[strlen(cmdline)-1] = '\0';
+
+        /* Scripts may have comments, like the #! line */
+        if (inputfd != STDIN_FILENO && cmdline[strspn(cmdline, " \t")] == '#')
+            continue;
         
         /* Evaluate the command line */
-        eval(cmdline);
+        if (record_line(cmdline)) {
+            eval(cmdline);
+            record_event("NEXT", 0); /* replay waits for the prompt */
+        }
+        else
+            eval(cmdline);
         
         fflush(stdout);
         fflush(stdout);
@@ -233,84 +876,329 @@ eval(char *cmdline)
     /* Declare variables */
     int bg, jid; /* Should the job run in bg or fg? */
     pid_t pid;           /* Process id */
-    struct cmdline_tokens tok;
+    pid_t pgid = 0;      /* Process group of the job, the first child's pid */
+    pid_t pids[MAXSTAGES]; /* Processes started for the pipeline */
+    int nprocs = 0;
+    struct pipeline_t pl;
+    struct cmdline_tokens *tok = &pl.stage[0];
     sigset_t prev, mask_three;
+    char expanded[MAXLINE]; /* cmdline after $ expansion */
+    int nassign, i, k, last;
+    int in_fd = -1;      /* Input of the next stage, -1 for our stdin */
+    int out_fd, pipe_fd[2];
+    int queued, hold_fd[2]; /* A queued job's children wait on hold_fd[0] */
+    int cgid = 0;        /* The job's cgroup with the freezer option */
+    int script;          /* The stage is a tsh script */
+    char progbuf[MAXLINE]; /* Where the PATH lookup puts the program */
+    const char *prog;    /* The program of the stage, NULL if none */
+    int gate[2] = {-1, -1}; /* Children wait on gate[0] for their counters */
+    int perffds[MAXSTAGES][NPERF]; /* Counters of each process, or -1 */
+    int timed;           /* The line began with time */
+    long start;
+    char c;
+    struct job_t *job;
 
     /* Initialize block sets */
     Sigemptyset(&mask_three);
     Sigaddset(&mask_three, SIGCHLD);
     Sigaddset(&mask_three, SIGINT);
     Sigaddset(&mask_three, SIGTSTP);
+    Sigaddset(&mask_three, SIGALRM); /* It dispatches queued jobs */
 
-    /* Parse command line */
-    if((bg = parseline(cmdline, &tok)) == -1) /* parsing error */
+    /* Expand and parse command line */
+    if(expandline(cmdline, expanded) < 0) /* expansion error */
         return;
-    if (tok.argv[0] == NULL) /* ignore empty lines */
+    if((bg = parsepipeline(expanded, &pl)) == -1) /* parsing error */
         return;
+    if (tok->argv[0] == NULL) /* ignore empty lines */
+        return;
+    if((timed = tok->timed) && bg)
+    {
+        report_error("time: cannot time a background job\n", NULL);
+        return;
+    }
+    start = now_ms();
 
-    /* Handling commands */
-    if(!builtin_command(&tok))
+    if(pl.nstages == 1)
     {
-        Sigprocmask(SIG_BLOCK, &mask_three, &prev); /* Block SIGCHLD */
-        
+        /* name=(word...) assigns a whole array */
+        if(assign_array(tok))
+            return;
+
+        /* Leading name=value words set variables */
+        for(nassign = 0; nassign < tok->argc && isassign(tok->argv[nassign]); nassign++)
+            ;
+        if(nassign == tok->argc) /* Only assignments: set shell variables */
+        {
+            for(i = 0; i < nassign; i++)
+                if(assign(tok->argv[i]) < 0)
+                    break;
+            return;
+        }
+
+        if(builtin_command(tok, STDOUT_FILENO))
+        {
+            if(timed) /* Only the wall time of a builtin */
+            {
+                memset(lastrun.count, 0xff, sizeof(lastrun.count));
+                lastrun.utime_us = lastrun.stime_us = 0;
+                lastrun.real_ms = now_ms() - start;
+                time_report(&lastrun, cmdline);
+            }
+            return;
+        }
+    }
+
+    /* 
+     * Handling commands. Builtin stages of a pipeline run right here,
+     * to completion, and leave their output in a memory file, which
+     * becomes the input of the next stage. They do not read their
+     * input: a pipe into one is closed, as when a reader exits early,
+     * and its writer may die of SIGPIPE. Only external commands are
+     * forked.
+     */
+    Sigprocmask(SIG_BLOCK, &mask_three, &prev); /* Block SIGCHLD */
+
+    /* 
+     * With maxjobs jobs running, a background job waits for its turn.
+     * A job in a pool always starts out queued, because its slot is
+     * taken in the name of its process group.
+     */
+    queued = curpool >= 0 || (bg && maxjobs > 0 && running_jobs() >= maxjobs);
+    if(queued && pipe2(hold_fd, O_CLOEXEC) < 0)
+        unix_error("pipe error");
+    if(freezer)
+        cgid = freezer_newgroup(); /* 0 if it fails: use signals */
+    memset(perffds, 0xff, sizeof(perffds));
+    if((timed || perfcount) && !perf_denied && pipe2(gate, O_CLOEXEC) < 0)
+        unix_error("pipe error");
+
+    for(i = 0; i < pl.nstages; i++)
+    {
+        tok = &pl.stage[i];
+        last = (i == pl.nstages - 1);
+
+        if(tok->builtins != BUILTIN_NONE) /* Builtin stage */
+        {
+            if(tok->builtins == BUILTIN_QUIT || tok->builtins == BUILTIN_FG
+               || tok->builtins == BUILTIN_BG)
+            {
+                report_error(tok->argv[0], ": cannot be used in a pipeline\n", NULL);
+                out_fd = last ? -1 : open("/dev/null", O_RDONLY | O_CLOEXEC);
+            }
+            else if(last)
+            {
+                builtin_command(tok, STDOUT_FILENO);
+                out_fd = -1;
+            }
+            else
+            {
+                if((out_fd = memfd_create("tsh-pipe", MFD_CLOEXEC)) < 0)
+                    unix_error("memfd_create error");
+                builtin_command(tok, out_fd);
+                lseek(out_fd, 0, SEEK_SET);
+            }
+            if(in_fd >= 0)
+                Close(in_fd);
+            in_fd = out_fd;
+            continue;
+        }
+
+        if(!last && pipe2(pipe_fd, O_CLOEXEC) < 0)
+            unix_error("pipe error");
+        prog = resolve_command(tok, progbuf);
+        script = prog != NULL && script_lookup(prog) != NULL;
+
         if((pid = Fork()) == 0)
         {
             /* Preparations */
             Sigprocmask(SIG_SETMASK, &prev, NULL); /* Unblock SIGCHLD in child process */
-            Setpgid(0, 0); /* put child in new process group */
+            Setpgid(0, pgid); /* put child in the job's process group */
+            if(cgid)
+                freezer_join(cgid, 0); /* and in its cgroup */
+            if(gate[0] >= 0) /* Count from the first instruction of exec */
+            {
+                Close(gate[1]);
+                while(read(gate[0], &c, 1) < 0 && errno == EINTR)
+                    ;
+                Close(gate[0]);
+            }
             /* restore default signal handler */
             signal(SIGCHLD, SIG_DFL); 
             signal(SIGINT, SIG_DFL);
             signal(SIGTSTP, SIG_DFL);
-            
-            /* I/O redirection */
-            if(tok.infile)
-            {
-                int fd_src = Open(tok.infile, O_RDONLY, 0);
-                dup2(fd_src, STDIN_FILENO);
-            }
-            if(tok.outfile)
-            {
-                umask(DEF_UMASK);
-                int fd_dst = Open(tok.outfile, O_CREAT | O_TRUNC | O_WRONLY, DEF_MODE);
-                dup2(fd_dst, STDOUT_FILENO);
-            }
 
-            /* Child run user job */
-            if(execve(tok.argv[0], tok.argv, environ) < 0)
+            if(queued) /* Block until release_job closes the other end */
             {
-                sio_puts(tok.argv[0]);
-                sio_puts("s: Command not found.\n");
+                Close(hold_fd[1]);
+                for(i = 0; i < MAXJOBS; i++)
+                    if(job_list[i].holdfd >= 0)
+                        close(job_list[i].holdfd);
+                while(read(hold_fd[0], &c, 1) < 0 && errno == EINTR)
+                    ;
+                Close(hold_fd[0]);
             }
-            exit(0);
+
+            /* Connect the pipeline */
+            if(in_fd >= 0)
+                dup2(in_fd, STDIN_FILENO);
+            if(!last)
+                dup2(pipe_fd[1], STDOUT_FILENO);
+
+            child_exec(tok, prog, script);
         }
-        /* Parent adds job */
-        addjob(job_list, pid, bg + 1, cmdline);
-        jid = pid2jid(pid);
+        /* Also set the group here, so the next stage can join it */
+        setpgid(pid, pgid ? pgid : pid);
+        if(cgid)
+            freezer_join(cgid, pid);
+        if(gate[0] >= 0)
+            perf_open(pid, perffds[nprocs]);
+        if(!pgid)
+            pgid = pid;
+        pids[nprocs++] = pid;
+
+        if(in_fd >= 0)
+            Close(in_fd);
+        in_fd = -1;
+        if(!last)
+        {
+            Close(pipe_fd[1]);
+            in_fd = pipe_fd[0];
+        }
+    }
+
+    if(queued)
+        Close(hold_fd[0]);
+    if(gate[0] >= 0) /* Counters are on: let the children go */
+    {
+        Close(gate[0]);
+        Close(gate[1]);
+    }
+    if(nprocs == 0) /* Every stage was a builtin */
+    {
+        if(queued)
+            Close(hold_fd[1]);
+        Sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
+    }
 
-        if(!bg) /* Child runs foreground */
+    /* Parent adds job */
+    addjob(job_list, pgid, queued ? QU : bg + 1, cmdline);
+    job = getjobpid(job_list, pgid);
+    for(i = 1; job && i < nprocs; i++)
+        job->pids[job->nprocs++] = pids[i];
+    if(job && pl.stage[pl.nstages - 1].builtins != BUILTIN_NONE)
+        job->laststage = -1;
+    for(i = 0; i < nprocs; i++)
+        for(k = 0; k < NPERF; k++)
+        {
+            if(job)
+                job->perffd[i][k] = perffds[i][k];
+            else if(perffds[i][k] >= 0)
+                close(perffds[i][k]);
+        }
+    if(job)
+    {
+        job->nlive = job->nprocs;
+        stats_setkey(job, &pl);
+        if(cgid)
+        {
+            job->cgid = cgid;
+            sprintf(sbuf, "%d/cgroup.events", cgid);
+            job->eventsfd = openat(freezerfd, sbuf, O_RDONLY | O_CLOEXEC);
+        }
+        if(queued)
         {
-            while (pid == fgpid(job_list)) /* Parent waits for foreground job to terminate */
-                Sigsuspend(&prev);
+            job->holdfd = hold_fd[1];
+            job->qstate = bg ? BG : FG;
+            job->expect_ms = stats_predict(job);
+            job->pool = curpool;
+            dispatch_jobs(); /* Start it now if there is room */
         }
-        else /* Child runs background */
+    }
+    else if(queued) /* No job slot: let it run anyway */
+        Close(hold_fd[1]);
+    jid = pid2jid(pgid);
+    if(job)
+        notice("start", job, NULL, 0);
+
+    if(!bg) /* Child runs foreground */
+    {
+        /* Parent waits for foreground job to be dispatched and terminate */
+        while (pgid == fgpid(job_list)
+               || ((job = getjobpid(job_list, pgid)) != NULL && job->state == QU))
+            wait_signal(&prev);
+        if(timed && lastrun_pgid == pgid) /* It ended, rather than stopped */
+            time_report(&lastrun, cmdline);
+    }
+    else /* Child runs background */
+    {
+        lastbg = pgid;
+        if(human())
         {
             /* Print prompt message */
             sio_puts("[");
             sio_putl(jid);
             sio_puts("] (");
-            sio_putl(pid);
+            sio_putl(pgid);
             sio_puts(") ");
             sio_puts(cmdline);
             sio_puts("\n");
         }
-        Sigprocmask(SIG_SETMASK, &prev, NULL); /* Unblock signals before return */
     }
+    Sigprocmask(SIG_SETMASK, &prev, NULL); /* Unblock signals before return */
     return;
 }
 
-/* Builtin_command - If first arg is a builtin command, run it and return true */
-int builtin_command(struct cmdline_tokens *tok)
+/* 
+ * child_exec - In a forked child, apply the I/O redirections of tok and
+ *     run its command, the program prog, right here if script says it is
+ *     a tsh script. Leading name=value words go to the environment.
+ *     Never returns.
+ */
+void child_exec(struct cmdline_tokens *tok, const char *prog, int script)
+{
+    int i, nassign;
+
+    /* I/O redirection */
+    if(tok->infile)
+    {
+        int fd_src = Open(tok->infile, O_RDONLY, 0);
+        dup2(fd_src, STDIN_FILENO);
+    }
+    if(tok->outfile)
+    {
+        umask(DEF_UMASK);
+        int fd_dst = Open(tok->outfile, O_CREAT | O_TRUNC | O_WRONLY, DEF_MODE);
+        dup2(fd_dst, STDOUT_FILENO);
+    }
+
+    /* Assignments before the command go to its environment */
+    for(nassign = 0; nassign < tok->argc && isassign(tok->argv[nassign]); nassign++)
+        ;
+    if(nassign == tok->argc)
+        exit(0);
+    for(i = 0; i < nassign; i++)
+        putenv(tok->argv[i]);
+    if(script) /* $0 is the path, as execve would have made it */
+    {
+        tok->argv[nassign] = (char *) prog;
+        script_exec(tok->argc - nassign, tok->argv + nassign);
+    }
+
+    /* Child run user job */
+    if(prog == NULL || execve(prog, tok->argv + nassign, environ) < 0)
+    {
+        report_error(tok->argv[nassign], "s: Command not found.\n", NULL);
+    }
+    exit(0);
+}
+
+/* 
+ * Builtin_command - If first arg is a builtin command, run it and return
+ *     true. Output that would go to stdout is written to output_fd.
+ */
+int builtin_command(struct cmdline_tokens *tok, int output_fd)
 {
     /* Declare and initialize block sets */
     sigset_t mask, prev;
@@ -322,16 +1210,24 @@ int builtin_command(struct cmdline_tokens *tok)
         execute_quit();
     else if(tok->builtins == BUILTIN_JOBS) /* Builtin command jobs */
     {
-        
+        int fd_dst = output_fd, v;
+
         if(tok->outfile) /* Output redirection */
         {
             umask(DEF_UMASK);
-            int fd_dst = Open(tok->outfile, O_CREAT | O_TRUNC | O_WRONLY, DEF_MODE);
-            listjobs(job_list, fd_dst);
-            Close(fd_dst);
+            fd_dst = Open(tok->outfile, O_CREAT | O_TRUNC | O_WRONLY, DEF_MODE);
         }
+        v = tok->argc > 1 && !strcmp(tok->argv[1], "-v"); /* With run times */
+        if(json)
+            listjobs_json(job_list, json_fd(fd_dst), v);
+        if(!human())
+            ;
+        else if(v)
+            listjobs_long(job_list, fd_dst);
         else
-            listjobs(job_list, STDOUT_FILENO);
+            listjobs(job_list, fd_dst);
+        if(tok->outfile)
+            Close(fd_dst);
         return 1;
     }
     else if(tok->builtins == BUILTIN_FG) /* Builtin command fg job */
@@ -344,6 +1240,51 @@ int builtin_command(struct cmdline_tokens *tok)
         execute_bg(tok);
         return 1;
     }
+    else if(tok->builtins == BUILTIN_LET) /* Builtin command let expr */
+    {
+        execute_let(tok);
+        return 1;
+    }
+    else if(tok->builtins == BUILTIN_DECLARE) /* Builtin command declare */
+    {
+        execute_declare(tok);
+        return 1;
+    }
+    else if(tok->builtins == BUILTIN_UNSET) /* Builtin command unset */
+    {
+        execute_unset(tok);
+        return 1;
+    }
+    else if(tok->builtins == BUILTIN_SET) /* Builtin command set */
+    {
+        execute_set(tok, output_fd);
+        return 1;
+    }
+    else if(tok->builtins == BUILTIN_MAXJOBS) /* Builtin command maxjobs [n] */
+    {
+        execute_maxjobs(tok, output_fd);
+        return 1;
+    }
+    else if(tok->builtins == BUILTIN_STATS) /* Builtin command stats */
+    {
+        execute_stats(tok, output_fd);
+        return 1;
+    }
+    else if(tok->builtins == BUILTIN_POOLS) /* Builtin command pools */
+    {
+        execute_pools(tok, output_fd);
+        return 1;
+    }
+    else if(tok->builtins == BUILTIN_EVERY || tok->builtins == BUILTIN_AT)
+    {
+        execute_timer(tok); /* Builtin command every/at interval cmd */
+        return 1;
+    }
+    else if(tok->builtins == BUILTIN_RECLAIM) /* Builtin command reclaim */
+    {
+        execute_reclaim(tok, output_fd);
+        return 1;
+    }
 
     return 0;
 }
@@ -380,51 +1321,60 @@ void execute_fg(struct cmdline_tokens *tok, sigset_t *pprev)
 {
     /* Declare and initialize variables */
     char *ID_str = tok->argv[1];
+    char num[24];
     int jid, pid;
     struct job_t *target_job;
+    sigset_t mask, prev;
 
     if(tok->argc != 2) /* Invalid format */
     {
-        sio_puts(tok->argv[0]);
         //sio_puts(" command requires PID or %%jobid argument\n");
-        sio_puts(" please input one and only one ID argument\n");
+        report_error(tok->argv[0], " please input one and only one ID argument\n", NULL);
         return;
     }
 
+    /* The job list and the pools must not change under us */
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGTSTP);
+    Sigaddset(&mask, SIGALRM);
+    Sigprocmask(SIG_BLOCK, &mask, &prev);
+
     /* Get target job by input id */
     if (ID_str[0] == '%') /* Input jid */
     {
         if(!(jid = atoi(ID_str + 1))) /* Jid is 0 or not a number */
         {
-            sio_puts(tok->argv[0]);
-            sio_puts(": argument must be a nonzero %%jobid\n");
+            report_error(tok->argv[0], ": argument must be a nonzero %%jobid\n", NULL);
+            Sigprocmask(SIG_SETMASK, &prev, NULL);
             return;
         }
         target_job = getjobjid(job_list, jid);
-        pid = target_job->pid;
         if(!target_job) /* Can not find the job*/
         {
-            sio_puts("[");
-            sio_putl(jid);
-            sio_puts("]: job with this jid do not exist\n");
+            sio_ltoa(jid, num, 10);
+            report_error("[", num, "]: job with this jid do not exist\n", NULL);
+            Sigprocmask(SIG_SETMASK, &prev, NULL);
             return;
         }
+        pid = target_job->pid;
     }
     else /* Input pid */
     {
         if(!(pid = atoi(ID_str))) /* Pid is 0 or not a number */
         {
-            sio_puts(tok->argv[0]);
-            sio_puts(": argument must be a nonzero PID\n");
+            report_error(tok->argv[0], ": argument must be a nonzero PID\n", NULL);
+            Sigprocmask(SIG_SETMASK, &prev, NULL);
             return;
         }
         target_job = getjobpid(job_list, pid);
         jid = pid2jid(pid);
         if(!target_job) /* Can not find the job*/
         {
-            sio_puts("(");
-            sio_putl(pid);
-            sio_puts("): process with this pid do not exist\n");
+            sio_ltoa(pid, num, 10);
+            report_error("(", num, "): process with this pid do not exist\n", NULL);
+            Sigprocmask(SIG_SETMASK, &prev, NULL);
             return;
         }
     }
@@ -432,15 +1382,30 @@ void execute_fg(struct cmdline_tokens *tok, sigset_t *pprev)
     /* Handling job */
     if(target_job ->state == UNDEF) /* Job's state undefined */
     {
-        sio_puts("error: trying to fg a process not exist\n");
+        report_error("error: trying to fg a process not exist\n", NULL);
+        Sigprocmask(SIG_SETMASK, &prev, NULL);
         return;
     }
     if(target_job -> state == ST) /* Restart a stopped job */
-        kill(-pid, SIGCONT);
-    target_job->state = FG;
+        job_resume(target_job);
+    if(target_job->state == QU && target_job->pool >= 0)
+    {
+        /* Still needs a slot of its pool: wait for it in the foreground */
+        target_job->qstate = FG;
+        while(getjobpid(job_list, pid) == target_job && target_job->state == QU)
+            wait_signal(pprev);
+    }
+    else
+    {
+        release_job(target_job); /* Start a queued job now */
+        target_job->state = FG;
+    }
+    if(target_job->state == FG)
+        notice("continue", target_job, NULL, 0);
     while(fgpid(job_list)) /* Parent waits for foreground job to terminate */
-        Sigsuspend(pprev);
+        wait_signal(pprev);
 
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
     return;
 }
 
@@ -449,50 +1414,59 @@ void execute_bg(struct cmdline_tokens *tok)
 {
     /* Declare and initialize variables */
     char *ID_str = tok->argv[1];
+    char num[24];
     int jid, pid;
     struct job_t *target_job;
+    sigset_t mask, prev;
 
     if(tok->argc != 2) /* Invalid format */
     {
-        sio_puts(tok->argv[0]);
-        sio_puts(" please input one and only one ID argument\n");
+        report_error(tok->argv[0], " please input one and only one ID argument\n", NULL);
         return;
     }
 
+    /* The job list and the pools must not change under us */
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGTSTP);
+    Sigaddset(&mask, SIGALRM);
+    Sigprocmask(SIG_BLOCK, &mask, &prev);
+
     /* Get target job by input id */
     if (ID_str[0] == '%') /* Input jid */
     {
         if(!(jid = atoi(ID_str + 1))) /* Jid is 0 or not a number */
         {
-            sio_puts(tok->argv[0]);
-            sio_puts(": argument must be a %%jobid\n");
+            report_error(tok->argv[0], ": argument must be a %%jobid\n", NULL);
+            Sigprocmask(SIG_SETMASK, &prev, NULL);
             return;
         }
         target_job = getjobjid(job_list, jid);
-        pid = target_job->pid;
         if(!target_job)
         {
-            sio_puts("[");
-            sio_putl(jid);
-            sio_puts("]: job with this jid do not exist\n");
+            sio_ltoa(jid, num, 10);
+            report_error("[", num, "]: job with this jid do not exist\n", NULL);
+            Sigprocmask(SIG_SETMASK, &prev, NULL);
             return;
         }
+        pid = target_job->pid;
     }
     else /* Input pid */
     {
         if(!(pid = atoi(ID_str)))
         {
-            sio_puts(tok->argv[0]);
-            sio_puts(": argument must be a PID\n");
+            report_error(tok->argv[0], ": argument must be a PID\n", NULL);
+            Sigprocmask(SIG_SETMASK, &prev, NULL);
             return;
         }
         target_job = getjobpid(job_list, pid);
         jid = pid2jid(pid);
         if(!target_job) /* Can not find the job*/
         {
-            sio_puts("(");
-            sio_putl(pid);
-            sio_puts("): process with this pid do not exist\n");
+            sio_ltoa(pid, num, 10);
+            report_error("(", num, "): process with this pid do not exist\n", NULL);
+            Sigprocmask(SIG_SETMASK, &prev, NULL);
             return;
         }
     }
@@ -500,13 +1474,26 @@ void execute_bg(struct cmdline_tokens *tok)
     /* Handling job */
     if(target_job == UNDEF)
     {
-        sio_puts("error: trying to bg a process not exist\n");
+        report_error("error: trying to bg a process not exist\n", NULL);
+        Sigprocmask(SIG_SETMASK, &prev, NULL);
         return;
     }
     if(target_job -> state == ST) /* Restart a stopped job */
-        kill(-pid, SIGCONT);
-    target_job->state = BG;
+        job_resume(target_job);
+    if(target_job->state == QU && target_job->pool >= 0)
+        target_job->qstate = BG; /* Still needs a slot of its pool */
+    else
+    {
+        release_job(target_job); /* Start a queued job now */
+        target_job->state = BG;
+    }
     /* Print prompt message */
+    notice("continue", target_job, NULL, 0);
+    if(!human())
+    {
+        Sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
+    }
     sio_puts("[");
     sio_putl(target_job->jid);
     sio_puts("] (");
@@ -515,511 +1502,5597 @@ void execute_bg(struct cmdline_tokens *tok)
     sio_puts(target_job->cmdline);
     sio_puts("\n");
 
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
     return;
 }
 
 
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Parameters:
- *   cmdline:  The command line, in the form:
- *
- *                command [arguments...] [< infile] [> oufile] [&]
- *
- *   tok:      Pointer to a cmdline_tokens structure. The elements of this
- *             structure will be populated with the parsed tokens. Characters 
- *             enclosed in single or double quotes are treated as a single
- *             argument. 
- * Returns:
- *   1:        if the user has requested a BG job
- *   0:        if the user has requested a FG job  
- *  -1:        if cmdline is incorrectly formatted
- * 
- * Note:       The string elements of tok (e.g., argv[], infile, outfile) 
- *             are statically allocated inside parseline() and will be 
- *             overwritten the next time this function is invoked.
- */
-int 
-parseline(const char *cmdline, struct cmdline_tokens *tok) 
+/* execute_let - execute build-in command let expr... */
+void execute_let(struct cmdline_tokens *tok)
 {
+    int i;
+    long long result;
 
-    static char array[MAXLINE];          /* holds local copy of command line */
-    const char delims[10] = " \t\r\n";   /* argument delimiters (white-space) */
-    char *buf = array;                   /* ptr that traverses command line */
-    char *next;                          /* ptr to the end of the current arg */
-    char *endbuf;                        /* ptr to end of cmdline string */
-    int is_bg;                           /* background job? */
-
-    int parsing_state;                   /* indicates if the next token is the
-                                            input or output file */
-
-    if (cmdline == NULL) {
-        (void) fprintf(stderr, "Error: command line is NULL\n");
-        return -1;
+    if(tok->argc < 2) /* Invalid format */
+    {
+        report_error(tok->argv[0], ": expression expected\n", NULL);
+        return;
     }
 
-    (void) strncpy(buf, cmdline, MAXLINE);
-    endbuf = buf + strlen(buf);
+    /* Evaluate every argument for its side effects */
+    for(i = 1; i < tok->argc; i++)
+        if(arith_eval(tok->argv[i], &result) < 0)
+            return;
 
-    tok->infile = NULL;
-    tok->outfile = NULL;
+    return;
+}
 
-    /* Build the argv list */
-    parsing_state = ST_NORMAL;
-    tok->argc = 0;
 
-    while (buf < endbuf) {
-        /* Skip the white-spaces */
-        buf += strspn (buf, delims);
-        if (buf >= endbuf) break;
+/* execute_declare - execute build-in command declare -a|-A name... */
+void execute_declare(struct cmdline_tokens *tok)
+{
+    int i, kind;
+    struct array_t *arr;
 
-        /* Check for I/O redirection specifiers */
-        if (*buf == '<') {
-            if (tok->infile) {
-                (void) fprintf(stderr, "Error: Ambiguous I/O redirection\n");
-                return -1;
-            }
-            parsing_state |= ST_INFILE;
-            buf++;
-            continue;
-        }
-        if (*buf == '>') {
-            if (tok->outfile) {
-                (void) fprintf(stderr, "Error: Ambiguous I/O redirection\n");
-                return -1;
-            }
-            parsing_state |= ST_OUTFILE;
-            buf ++;
+    if(tok->argc < 3 || (strcmp(tok->argv[1], "-a") && strcmp(tok->argv[1], "-A")))
+    {
+        report_error(tok->argv[0], ": usage: declare -a|-A name...\n", NULL);
+        return;
+    }
+    kind = tok->argv[1][1] == 'A' ? ARR_ASSOC : ARR_INDEXED;
+
+    for(i = 2; i < tok->argc; i++)
+    {
+        /* Declaring an existing array of the same kind keeps it */
+        if((arr = getarray(tok->argv[i])) != NULL && arr->kind == kind)
             continue;
-        }
+        newarray(tok->argv[i], kind);
+    }
+    return;
+}
 
-        if (*buf == '\'' || *buf == '\"') {
-            /* Detect quoted tokens */
-            buf++;
-            next = strchr (buf, *(buf-1));
-        } else {
-            /* Find next delimiter */
-            next = buf + strcspn (buf, delims);
-        }
-        
-        if (next == NULL) {
-            /* Returned by strchr(); this means that the closing
-               quote was not found. */
-            (void) fprintf (stderr, "Error: unmatched %c.\n", *(buf-1));
-            return -1;
+/* execute_unset - execute build-in command unset name... or name[sub]... */
+void execute_unset(struct cmdline_tokens *tok)
+{
+    int i;
+    char *sub, *rb;
+    struct array_t *arr;
+
+    for(i = 1; i < tok->argc; i++)
+    {
+        if((sub = strchr(tok->argv[i], '[')) != NULL
+           && (rb = strrchr(sub, ']')) != NULL && rb[1] == '\0')
+        {
+            /* Remove one element */
+            *sub++ = '\0';
+            *rb = '\0';
+            if((arr = getarray(tok->argv[i])) != NULL)
+                array_unset(arr, sub);
+            continue;
         }
+        unsetvar(tok->argv[i]);
+        if((arr = getarray(tok->argv[i])) != NULL)
+            deletearray(arr);
+    }
+    return;
+}
 
-        /* Terminate the token */
-        *next = '\0';
+/* execute_set - execute build-in command set [-o|+o name] */
+void execute_set(struct cmdline_tokens *tok, int output_fd)
+{
+    int i;
 
-        /* Record the token as either the next argument or the i/o file */
-        switch (parsing_state) {
-        case ST_NORMAL:
-            tok->argv[tok->argc++] = buf;
-            break;
-        case ST_INFILE:
-            tok->infile = buf;
-            break;
-        case ST_OUTFILE:
-            tok->outfile = buf;
-            break;
-        default:
-            (void) fprintf(stderr, "Error: Ambiguous I/O redirection\n");
-            return -1;
+    if(tok->argc == 1 || (tok->argc == 2 && !strcmp(tok->argv[1], "-o")))
+    {
+        /* List the options */
+        for(i = 0; shopts[i].name; i++)
+        {
+            sprintf(sbuf, "%-15s %s\n", shopts[i].name, *shopts[i].flag ? "on" : "off");
+            if(write(output_fd, sbuf, strlen(sbuf)) < 0)
+                unix_error("set: write error");
         }
-        parsing_state = ST_NORMAL;
+        return;
+    }
+    if(tok->argc != 3 || (strcmp(tok->argv[1], "-o") && strcmp(tok->argv[1], "+o")))
+    {
+        report_error(tok->argv[0], ": usage: set [-o|+o name]\n", NULL);
+        return;
+    }
+    setoption(tok->argv[2], tok->argv[1][0] == '-');
+    return;
+}
 
-        /* Check if argv is full */
-        if (tok->argc >= MAXARGS-1) break;
+/* execute_maxjobs - execute build-in command maxjobs [n] */
+void execute_maxjobs(struct cmdline_tokens *tok, int output_fd)
+{
+    sigset_t mask_all, prev;
+    char *end;
+    long n;
 
-        buf = next + 1;
+    if(tok->argc == 1) /* Show the limit */
+    {
+        sprintf(sbuf, "%d\n", maxjobs);
+        if(write(output_fd, sbuf, strlen(sbuf)) < 0)
+            unix_error("maxjobs: write error");
+        return;
     }
-
-    if (parsing_state != ST_NORMAL) {
-        (void) fprintf(stderr,
-                       "Error: must provide file name for redirection\n");
-        return -1;
+    n = strtol(tok->argv[1], &end, 10);
+    if(tok->argc != 2 || *end != '\0' || n < 0 || n > MAXJOBS)
+    {
+        report_error(tok->argv[0], ": usage: maxjobs [n], 0 for no limit\n", NULL);
+        return;
     }
 
-    /* The argument list must end with a NULL pointer */
-    tok->argv[tok->argc] = NULL;
+    /* A higher limit may let queued jobs start */
+    Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev);
+    maxjobs = n;
+    dispatch_jobs();
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+    return;
+}
 
-    if (tok->argc == 0)  /* ignore blank line */
-        return 1;
+/* execute_stats - execute build-in command stats, listing run times */
+void execute_stats(struct cmdline_tokens *tok, int output_fd)
+{
+    struct cmdstat_t copy, *st = &copy;
+    struct jw_t w;
+    int i;
 
-    if (!strcmp(tok->argv[0], "quit")) {                 /* quit command */
-        tok->builtins = BUILTIN_QUIT;
-    } else if (!strcmp(tok->argv[0], "jobs")) {          /* jobs command */
-        tok->builtins = BUILTIN_JOBS;
-    } else if (!strcmp(tok->argv[0], "bg")) {            /* bg command */
-        tok->builtins = BUILTIN_BG;
-    } else if (!strcmp(tok->argv[0], "fg")) {            /* fg command */
-        tok->builtins = BUILTIN_FG;
-    } else {
-        tok->builtins = BUILTIN_NONE;
+    for(i = 0; i < MAXSTATS; i++)
+    {
+        if(!stats_read(&statsfile->stats[i], st) || st->key == 0)
+            continue;
+        if(json)
+        {
+            sprintf(sbuf, "%016lx", st->key);
+            jw_begin(&w, json_fd(output_fd), "stat");
+            jw_str(&w, "key", sbuf);
+            jw_str(&w, "name", st->name);
+            jw_int(&w, "runs", st->runs);
+            jw_int(&w, "mean_ms", st->mean_ms);
+            jw_end(&w);
+        }
+        if(!human())
+            continue;
+        sprintf(sbuf, "%016lx %-15s %6u runs %8u ms\n",
+                st->key, st->name, st->runs, st->mean_ms);
+        if(write(output_fd, sbuf, strlen(sbuf)) < 0)
+            unix_error("stats: write error");
     }
+    return;
+}
 
-    /* Should the job run in the background? */
-    if ((is_bg = (*tok->argv[tok->argc-1] == '&')) != 0)
-        tok->argv[--tok->argc] = NULL;
+/* 
+ * execute_pools - execute build-in command pools, one of
+ *     pools                 list the pools and who holds their slots
+ *     pools name limit      create pool name, or change its limit
+ *     pools -u [name|-]     put new jobs in pool name, or in none
+ */
+void execute_pools(struct cmdline_tokens *tok, int output_fd)
+{
+    struct pool_t *pool;
+    char *end;
+    int i, j, used;
+    long n;
 
-    return is_bg;
+    if(tok->argc == 2 && !strcmp(tok->argv[1], "-u") && curpool < 0)
+    {
+        report_error("no pool\n", NULL);
+        return;
+    }
+    if(pools_open() < 0)
+        return;
+
+    if(tok->argc == 1) /* List the pools */
+    {
+        for(i = 0; i < MAXPOOLS; i++)
+        {
+            pool = &poolfile->pool[i];
+            if(pool->name[0] == '\0')
+                continue;
+            for(used = j = 0; j < MAXSLOTS; j++)
+                used += pool->slot[j].job != 0;
+            sprintf(sbuf, "%-15s %2d/%-2d%s", pool->name, used, pool->limit,
+                    i == curpool ? " (current)" : "");
+            for(j = 0; j < MAXSLOTS; j++)
+                if(pool->slot[j].job != 0)
+                    sprintf(sbuf + strlen(sbuf), " %d(%d)%s", pool->slot[j].job,
+                            pool->slot[j].shell,
+                            pool_holder_dead(&pool->slot[j]) ? "[dead]" : "");
+            strcat(sbuf, "\n");
+            if(write(output_fd, sbuf, strlen(sbuf)) < 0)
+                unix_error("pools: write error");
+        }
+        return;
+    }
+    if(tok->argc == 2 && !strcmp(tok->argv[1], "-u")) /* Show current pool */
+    {
+        sprintf(sbuf, "%s\n", poolfile->pool[curpool].name);
+        if(write(output_fd, sbuf, strlen(sbuf)) < 0)
+            unix_error("pools: write error");
+        return;
+    }
+    if(tok->argc == 3 && !strcmp(tok->argv[1], "-u")) /* Select a pool */
+    {
+        if(!strcmp(tok->argv[2], "-"))
+            curpool = -1;
+        else if((i = pool_find(tok->argv[2], 0)) < 0)
+        {
+            report_error(tok->argv[0], ": ", tok->argv[2], ": no such pool\n", NULL);
+        }
+        else
+            curpool = i;
+        return;
+    }
+
+    n = tok->argc == 3 ? strtol(tok->argv[2], &end, 10) : -1;
+    if(tok->argc != 3 || *end != '\0' || n < 0 || n > MAXSLOTS
+       || strlen(tok->argv[1]) >= MAXNAME)
+    {
+        report_error(tok->argv[0], ": usage: pools [name limit | -u [name|-]]\n", NULL);
+        return;
+    }
+    if((i = pool_find(tok->argv[1], 1)) < 0)
+    {
+        report_error(tok->argv[0], ": too many pools\n", NULL);
+        return;
+    }
+    /* A lower limit takes effect as the slots above it are given back */
+    poolfile->pool[i].limit = n;
+    pool_wake();
+    return;
 }
 
+/* 
+ * parse_interval - Parse a duration such as 500ms, 30, 30s, 5m or 2h
+ *     (seconds by default) into ms. Returns -1 if it is malformed or
+ *     beyond the reach of the timer wheel.
+ */
+static long parse_interval(const char *s)
+{
+    static const struct { const char *unit; long ms; } units[] = {
+        {"", 1000}, {"ms", 1}, {"s", 1000}, {"m", 60000}, {"h", 3600000}, {NULL, 0}
+    };
+    char *end;
+    long n;
+    int i;
 
-/*****************
- * Signal handlers
- *****************/
+    if(!isdigit((unsigned char) *s))
+        return -1;
+    n = strtol(s, &end, 10);
+    for(i = 0; units[i].unit; i++)
+        if(!strcmp(end, units[i].unit))
+            break;
+    if(!units[i].unit
+       || n >= ((long) TICK_MS << (WHEEL_BITS * WHEEL_LEVELS)) / units[i].ms)
+        return -1;
+    return n * units[i].ms;
+}
 
 /* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP, SIGTSTP, SIGTTIN or SIGTTOU signal. The 
- *     handler reaps all available zombie children, but doesn't wait 
- *     for any other currently running children to terminate.  
+ * execute_timer - execute build-in commands
+ *     every [-p skip|queue|kill] interval cmd...
+ *     at delay cmd...
+ *     every -d id, at -d id     cancel a timer
+ *     The command runs as a background job. A single word is kept as
+ *     it is and expanded again on every run; several words, already
+ *     expanded, are single-quoted, a ' in one becoming '"'"'.
  */
-void 
-sigchld_handler(int sig) 
+void execute_timer(struct cmdline_tokens *tok)
 {
-    /* Declare variables */
-    int olderrno = errno, status;
-    sigset_t mask_all, prev;
-    pid_t pid;
-    struct job_t *job;
+    static const char *policies[] = {"skip", "queue", "kill", NULL};
+    int every = tok->builtins == BUILTIN_EVERY;
+    int policy = OVL_SKIP, i = 1, n;
+    char line[MAXLINE], *p, *end = line + MAXLINE - 1, *w;
+    long ms;
 
-    /* Initialize block sets */
-    Sigfillset(&mask_all);
+    if(tok->argc == 3 && !strcmp(tok->argv[1], "-d")) /* Cancel a timer */
+    {
+        n = atoi(tok->argv[2] + (tok->argv[2][0] == 'T'));
+        if(n < 1 || n > MAXTIMERS || !timer_list[n - 1].used)
+        {
+            report_error(tok->argv[0], ": ", tok->argv[2], ": no such timer\n", NULL);
+            return;
+        }
+        timer_cancel(&timer_list[n - 1]);
+        return;
+    }
 
-    /* Parent reaps zombie child */
-    while((pid = waitpid(-1, &status, WNOHANG | WUNTRACED))>0)
+    if(every && tok->argc > 2 && !strcmp(tok->argv[1], "-p"))
     {
-        Sigprocmask(SIG_BLOCK, &mask_all, &prev); /* Block all signals */
-        job = getjobpid(job_list, pid);
+        for(policy = 0; policies[policy]; policy++)
+            if(!strcmp(tok->argv[2], policies[policy]))
+                break;
+        i = 3;
+    }
+    if(tok->argc - i < 2 || !policies[policy]
+       || (ms = parse_interval(tok->argv[i])) < 0 || (every && ms == 0))
+    {
+        report_error(tok->argv[0], every
+                     ? ": usage: every [-p skip|queue|kill] interval command\n"
+                     : ": usage: at delay command\n", NULL);
+        return;
+    }
 
-        if(WIFSTOPPED(status)) /* Child is stopped */
+    /* The command line to run */
+    if(tok->argc - i == 2)
+        snprintf(line, MAXLINE, "%s", tok->argv[i + 1]);
+    else
+    {
+        for(p = line, n = i + 1; n < tok->argc && p < end; n++)
         {
-            /* 
-            * If child stopped by SIGTSTP from shell, then 
-            * sigtstp_handler will deal with it. However, if 
-            * it was stopped by a signal didn't caught by shell, 
-            * then sigchld_handler should change the state 
-            * and print message. If child's state did not 
-            * change, it is because of a signal didn't caught
-            * by shell. One example is trace 12, where the child
-            * send itself SIGTSTP. In this case, handler should 
-            * change the state and print prompt message.
-            */
-            if(job->state != ST) 
+            if(n > i + 1)
+                *p++ = ' ';
+            for(w = tok->argv[n], *p++ = '\''; *w && p + 5 < end; w++)
             {
-                sio_puts("Job [");
-                sio_putl(job->jid);
-                sio_puts("] (");
-                sio_putl(job->pid);
-                sio_puts(") stopped by signal ");
-                sio_putl(WSTOPSIG(status));
-                sio_puts("\n");
-                job->state = ST;
+                if(*w == '\'')
+                    p = stpcpy(p, "'\"'\"'");
+                else
+                    *p++ = *w;
             }
+            if(*w || p >= end)
+                p = end;
+            else
+                *p++ = '\'';
         }
-        else if (WIFSIGNALED(status)) /* Child terminated by a signal */
+        if(p >= end)
         {
-            /* Print prompt message */
-            sio_puts("Job ["  );
-            sio_putl(job->jid);
-            sio_puts("] (");
-            sio_putl(job->pid);
-            sio_puts(") terminated by signal ");
-            sio_putl(WTERMSIG(status));
-            sio_puts("\n");
-            /* Delete job */
-            deletejob(job_list, pid);
+            report_error(tok->argv[0], ": command too long\n", NULL);
+            return;
         }
-        else if(WIFEXITED(status)) /* Child terminated normally */
-            /* Just delete job */
-            deletejob(job_list, pid);
-
-        /* Unblock signals */
-        Sigprocmask(SIG_SETMASK, &prev, NULL);
+        *p = '\0';
+    }
+    for(p = line + strlen(line); p > line && isspace((unsigned char) p[-1]); p--)
+        ;
+    if(p > line && p[-1] == '&')
+    {
+        report_error(tok->argv[0], ": command runs in the background already;"
+                     " leave out the &\n", NULL);
+        return;
     }
 
-    errno = olderrno;
-
+    if(timer_add(ms, every ? ms : 0, policy, line) == NULL)
+        report_error(tok->argv[0], ": too many timers\n", NULL);
     return;
 }
 
 /* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenver the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.  
+ * execute_reclaim - execute build-in command reclaim, one of
+ *     reclaim               show the setting
+ *     reclaim [-c] grace    page out the memory of jobs stopped for
+ *                           grace, or with -c only mark it cold
+ *     reclaim off           stop reclaiming
  */
-void 
-sigint_handler(int sig) 
+void execute_reclaim(struct cmdline_tokens *tok, int output_fd)
+{
+    int cold = tok->argc > 1 && !strcmp(tok->argv[1], "-c");
+    long grace;
+
+    if(tok->argc == 1) /* Show the setting */
+    {
+        if(reclaim_grace < 0)
+            sprintf(sbuf, "off\n");
+        else
+            sprintf(sbuf, "%s after %ldms\n",
+                    reclaim_advice == MADV_COLD ? "cold" : "pageout", reclaim_grace);
+        if(write(output_fd, sbuf, strlen(sbuf)) < 0)
+            unix_error("reclaim: write error");
+        return;
+    }
+    if(tok->argc == 2 && !strcmp(tok->argv[1], "off"))
+    {
+        reclaim_grace = -1;
+        return;
+    }
+    if(tok->argc != 2 + cold || (grace = parse_interval(tok->argv[1 + cold])) < 0)
+    {
+        report_error(tok->argv[0], ": usage: reclaim [[-c] grace | off]\n", NULL);
+        return;
+    }
+
+    if(reclaim_stats == NULL)
+    {
+        reclaim_stats = mmap(NULL, MAXJOBS * sizeof(struct reclaim_t), PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(reclaim_stats == MAP_FAILED)
+        {
+            reclaim_stats = NULL;
+            report_error(tok->argv[0], ": ", strerror(errno), "\n", NULL);
+            return;
+        }
+    }
+    reclaim_grace = grace;
+    reclaim_advice = cold ? MADV_COLD : MADV_PAGEOUT;
+    reclaim_run(); /* Jobs stopped already count from when they stopped */
+    return;
+}
+
+/* setoption - Turn shell option name on or off, returning 0 if it exists */
+int setoption(const char *name, int value)
+{
+    int i;
+
+    for(i = 0; shopts[i].name; i++)
+    {
+        if(!strcmp(shopts[i].name, name))
+        {
+            if(value && shopts[i].enable && shopts[i].enable() < 0)
+                return -1;
+            *shopts[i].flag = value;
+            return 0;
+        }
+    }
+    report_error("set: ", (char *) name, ": invalid option name\n", NULL);
+    return -1;
+}
+
+/* 
+ * isassign - Return true if word has the form name=value, name+=value,
+ *     name[sub]=value or name[sub]+=value
+ */
+int isassign(const char *word)
+{
+    const char *p = word;
+
+    if (!isalpha((unsigned char) *p) && *p != '_')
+        return 0;
+    while (isalnum((unsigned char) *p) || *p == '_')
+        p++;
+    if (*p == '[' && (p = strchr(p, ']')) != NULL)
+        p++;
+    if (p != NULL && *p == '+')
+        p++;
+    return p != NULL && *p == '=';
+}
+
+/* isarrayassign - Return true if word starts name=( or name+=( */
+int isarrayassign(const char *word)
+{
+    const char *p = word;
+
+    if (!isalpha((unsigned char) *p) && *p != '_')
+        return 0;
+    while (isalnum((unsigned char) *p) || *p == '_')
+        p++;
+    if (*p == '+')
+        p++;
+    return p[0] == '=' && p[1] == '(';
+}
+
+/* assign - Perform one assignment word accepted by isassign */
+int assign(char *word)
+{
+    char *p = word, *sub = NULL, *value, *old;
+    char joined[MAXLINE];
+    struct array_t *arr;
+    int append;
+
+    while (isalnum((unsigned char) *p) || *p == '_')
+        p++;
+    if (*p == '[') {
+        *p++ = '\0';
+        sub = p;
+        p = strchr(p, ']');
+        *p++ = '\0';
+    }
+    append = (*p == '+');
+    *p = '\0';
+    value = p + append + 1;
+
+    /* name+=value appends to the current value */
+    if (append) {
+        if (sub == NULL)
+            old = getvar(word);
+        else if ((arr = getarray(word)) == NULL)
+            old = NULL;
+        else if (array_lookup(arr, sub, &old) < 0)
+            return -1;
+        if (old != NULL) {
+            if (strlen(old) + strlen(value) >= MAXLINE) {
+                report_error(word, ": value too long\n", NULL);
+                return -1;
+            }
+            strcpy(joined, old);
+            strcat(joined, value);
+            value = joined;
+        }
+    }
+
+    if (sub == NULL)
+        return setvar(word, value) ? 0 : -1;
+    if ((arr = getarray(word)) == NULL && (arr = newarray(word, ARR_INDEXED)) == NULL)
+        return -1;
+    return array_set(arr, sub, value);
+}
+
+/* 
+ * assign_array - If the command is name=(word...) or name+=(word...),
+ *     perform it and return true. Words of the form [sub]=value set that
+ *     subscript; other words are appended to an indexed array. Braces
+ *     are expanded here, one element at a time, so a long sequence never
+ *     goes through argv.
+ */
+int assign_array(struct cmdline_tokens *tok)
+{
+    char *name = tok->argv[0], *p = name, *word, *last, *eq;
+    char item[MAXLINE];
+    struct array_t *arr;
+    struct brace_t br;
+    size_t n;
+    int i, append, more;
+
+    if (!isalpha((unsigned char) *p) && *p != '_')
+        return 0;
+    while (isalnum((unsigned char) *p) || *p == '_')
+        p++;
+    append = (*p == '+');
+    if (p[append] != '=' || p[append+1] != '(')
+        return 0;
+
+    word = p + append + 2;
+    *p = '\0';
+    last = tok->argc > 1 ? tok->argv[tok->argc-1] : word;
+    if ((n = strlen(last)) == 0 || last[n-1] != ')') {
+        report_error(name, ": missing )\n", NULL);
+        return 1;
+    }
+    last[n-1] = '\0';
+
+    arr = getarray(name);
+    if (!append || arr == NULL)
+        arr = newarray(name, arr ? arr->kind : ARR_INDEXED);
+    if (arr == NULL)
+        return 1;
+
+    for (i = 0; i < tok->argc; i++, word = tok->argv[i]) {
+        if (*word == '\0' && (i == 0 || i == tok->argc-1))
+            continue;  /* the space in "( a b )" */
+        if (*word == '[' && (eq = strstr(word, "]=")) != NULL) {
+            *eq = '\0';
+            if (array_set(arr, word + 1, eq + 2) < 0)
+                return 1;
+        }
+        else if (tok->lazy[i] && brace_init(&br, word, tok->lit[i] == NULL ? NULL
+                                            : tok->lit[i] + (word - tok->argv[i])) > 0) {
+            while ((more = brace_next(&br, item, MAXLINE)) > 0)
+                if (array_append(arr, item) < 0)
+                    return 1;
+            if (more < 0) {
+                report_error(name, ": ", word, ": word too long\n", NULL);
+                return 1;
+            }
+        }
+        else if (array_append(arr, word) < 0)
+            return 1;
+    }
+    return 1;
+}
+
+/***********************************************
+ * Brace expansion routines
+ **********************************************/
+
+/* 
+ * brace_seq - Parse the inside of {x..y} or {x..y..step} into g.
+ *     Returns true if it is a sequence of numbers or of letters.
+ */
+static int 
+brace_seq(const char *p, const char *close, struct brace_group_t *g) 
+{
+    char text[64], *a, *b, *c = NULL, *end;
+    long last, step = 1;
+    size_t n = close - p;
+
+    if (n >= sizeof(text))
+        return 0;
+    memcpy(text, p, n);
+    text[n] = '\0';
+    a = text;
+    if ((b = strstr(a, "..")) == NULL)
+        return 0;
+    *b = '\0';
+    b += 2;
+    if ((c = strstr(b, "..")) != NULL) {
+        *c = '\0';
+        c += 2;
+        step = strtol(c, &end, 10);
+        if (*c == '\0' || *end != '\0' || errno == ERANGE || step == LONG_MIN)
+            return 0;
+    }
+    if (step == 0)
+        step = 1;
+    if (step < 0)
+        step = -step;
+
+    g->letters = isalpha((unsigned char) a[0]) && a[1] == '\0'
+        && isalpha((unsigned char) b[0]) && b[1] == '\0';
+    if (g->letters) {
+        g->first = a[0];
+        last = b[0];
+        g->width = 0;
+    }
+    else {
+        g->first = strtol(a, &end, 10);
+        if (*a == '\0' || *end != '\0' || errno == ERANGE)
+            return 0;
+        last = strtol(b, &end, 10);
+        if (*b == '\0' || *end != '\0' || errno == ERANGE)
+            return 0;
+        /* {01..10}: as wide as the wider end, sign included */
+        g->width = 0;
+        if ((a[a[0] == '-'] == '0' && a[(a[0] == '-') + 1] != '\0')
+            || (b[b[0] == '-'] == '0' && b[(b[0] == '-') + 1] != '\0'))
+            g->width = strlen(a) > strlen(b) ? strlen(a) : strlen(b);
+    }
+    g->step = last >= g->first ? step : -step;
+    g->count = (last >= g->first ? (unsigned long) last - (unsigned long) g->first
+                : (unsigned long) g->first - (unsigned long) last) / (unsigned long) step;
+    if (g->count == ULONG_MAX) /* One more item than an unsigned long counts */
+        return 0;
+    g->count++;
+    g->seq = 1;
+    return 1;
+}
+
+/* brace_find - The first c at or after p that is not quoted, or NULL */
+static const char *
+brace_find(struct brace_t *b, const char *p, int c) 
+{
+    for (; (p = strchr(p, c)) != NULL; p++)
+        if (b->lit == NULL || !b->lit[p - b->word])
+            return p;
+    return NULL;
+}
+
+/* 
+ * brace_init - Find the brace groups of word for brace_next. Returns
+ *     their number; 0 means that word is left as it is. Braces and
+ *     commas whose byte of lit is true are quoted text, not syntax.
+ */
+int 
+brace_init(struct brace_t *b, const char *word, const char *lit) 
+{
+    struct brace_group_t *g;
+    const char *p, *q, *close;
+
+    b->word = word;
+    b->lit = lit;
+    b->ngroups = 0;
+    b->done = 0;
+    for (p = word; (p = brace_find(b, p, '{')) != NULL && b->ngroups < MAXBRACES; p++) {
+        /* A group holds no other braces */
+        if ((close = brace_find(b, p + 1, '}')) == NULL)
+            break;
+        if ((q = brace_find(b, p + 1, '{')) != NULL && q < close)
+            continue;
+        g = &b->group[b->ngroups];
+        memset(g, 0, sizeof(*g));
+        g->open = p;
+        g->close = close;
+        if ((q = brace_find(b, p + 1, ',')) != NULL && q < close) {
+            for (g->count = 1; q != NULL && q < close; q = brace_find(b, q + 1, ','))
+                g->count++;
+        }
+        else {
+            /* A sequence is all unquoted */
+            for (q = p + 1; lit != NULL && q < close && !lit[q - word]; q++)
+                ;
+            errno = 0;
+            if ((lit != NULL && q < close) || !brace_seq(p + 1, close, g))
+                continue;
+        }
+        b->ngroups++;
+        p = close;
+    }
+    return b->ngroups;
+}
+
+/* 
+ * brace_next - Write the next word of b into out, which holds size
+ *     bytes, skipping empty words. Returns 1, 0 once there are no more
+ *     words, or -1 if the word does not fit.
+ */
+int 
+brace_next(struct brace_t *b, char *out, size_t size) 
+{
+    struct brace_group_t *g;
+    const char *p, *q, *from;
+    char num[64];           /* As wide as brace_seq lets a number be */
+    unsigned long k;
+    size_t len;
+    int i;
+
+    while (!b->done) {
+        len = 0;
+        from = b->word;
+        for (i = 0; i <= b->ngroups; i++) {
+            g = &b->group[i];
+            /* The text before the group, or after the last one */
+            p = i < b->ngroups ? g->open : from + strlen(from);
+            if (len + (p - from) >= size)
+                return -1;
+            memcpy(out + len, from, p - from);
+            len += p - from;
+            if (i == b->ngroups)
+                break;
+
+            /* The group's current item */
+            if (g->seq && g->letters) {
+                num[0] = g->first + (long) g->at * g->step; /* Between a and z */
+                num[1] = '\0';
+                p = num;
+                q = num + 1;
+            }
+            else if (g->seq) {
+                /* Between first and last, but at * step may not fit a long */
+                snprintf(num, sizeof(num), "%0*ld", g->width,
+                         (long) ((unsigned long) g->first
+                                 + g->at * (unsigned long) g->step));
+                p = num;
+                q = num + strlen(num);
+            }
+            else {
+                for (k = g->at, p = g->open + 1; k > 0; p = q + 1)
+                    k -= (q = brace_find(b, p, ',')) != NULL && q < g->close;
+                if ((q = brace_find(b, p, ',')) == NULL || q > g->close)
+                    q = g->close;
+            }
+            if (len + (q - p) >= size)
+                return -1;
+            memcpy(out + len, p, q - p);
+            len += q - p;
+            from = g->close + 1;
+        }
+        out[len] = '\0';
+
+        /* Step the odometer, the last group fastest */
+        for (i = b->ngroups - 1; i >= 0; i--) {
+            if (++b->group[i].at < b->group[i].count)
+                break;
+            b->group[i].at = 0;
+        }
+        b->done = (i < 0);
+        if (len > 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* brace_count - Number of words b makes, at most ULONG_MAX */
+unsigned long 
+brace_count(struct brace_t *b) 
+{
+    unsigned long n = 1;
+    int i;
+
+    for (i = 0; i < b->ngroups; i++)
+        n = b->group[i].count > ULONG_MAX / n ? ULONG_MAX : n * b->group[i].count;
+    return n;
+}
+/******************************
+ * end brace expansion routines
+ ******************************/
+
+/* 
+ * parseline - Parse the command line and build the argv array.
+ * 
+ * Parameters:
+ *   cmdline:  The command line, in the form:
+ *
+ *                command [arguments...] [< infile] [> oufile] [&]
+ *
+ *   tok:      Pointer to a cmdline_tokens structure. The elements of this
+ *             structure will be populated with the parsed tokens. Characters 
+ *             enclosed in single or double quotes are treated as a single
+ *             argument. 
+ * Returns:
+ *   1:        if the user has requested a BG job
+ *   0:        if the user has requested a FG job  
+ *  -1:        if cmdline is incorrectly formatted
+ * 
+ * Note:       The string elements of tok (e.g., argv[], infile, outfile) 
+ *             are statically allocated inside parseline() and will be 
+ *             overwritten the next time this function is invoked.
+ */
+int 
+parseline(const char *cmdline, struct cmdline_tokens *tok) 
+{
+
+    static char array[MAXLINE];          /* holds local copy of command line */
+    static struct wordbuf_t words;       /* and the words of brace expansion */
+
+    if (cmdline == NULL) {
+        report_error("Error: command line is NULL\n", NULL);
+        return -1;
+    }
+
+    (void) strncpy(array, cmdline, MAXLINE);
+    array[MAXLINE-1] = '\0';
+    words.len = 0;
+    return parsetokens(array, tok, &words);
+}
+
+/* 
+ * quote_end - The quote closing the one at p, or NULL. Quotes that came
+ *     out of an expansion, after EXP_LITERAL, do not close it.
+ */
+static char *
+quote_end(char *p)
+{
+    char *q;
+
+    for (q = p + 1; *q != '\0' && *q != *p; q++)
+        if (*q == EXP_LITERAL && q[1] != '\0')
+            q++;
+    return *q == '\0' ? NULL : q;
+}
+
+/* 
+ * parsetokens - Like parseline, but tokenizes the writable string buf
+ *     in place. The elements of tok point into buf, or into words for
+ *     the words of brace expansion. The words of name=(...) keep their
+ *     braces, marked in tok->lazy, for assign_array to expand.
+ */
+int 
+parsetokens(char *buf, struct cmdline_tokens *tok, struct wordbuf_t *words) 
+{
+    const char delims[10] = " \t\r\n";   /* argument delimiters (white-space) */
+    char *next;                          /* ptr to the end of the current arg */
+    char *token, *dst, *close;           /* token start, unquoting cursors */
+    char quote;                          /* quote character being matched */
+    struct array_t *arr;                 /* array spliced into argv */
+    size_t pos;
+    char *key, *value;
+    char *endbuf;                        /* ptr to end of cmdline string */
+    int is_bg;                           /* background job? */
+    int quoted;                          /* the token has a quoted brace or comma */
+    char lit[MAXLINE];                   /* per byte of the token: quoted */
+    int spliced;                         /* the token is an ARR_MARKER */
+    int literal = 0;                     /* the last argument began with a value */
+    struct brace_t br;                   /* brace expansion of the token */
+    int n;
+
+    int parsing_state;                   /* indicates if the next token is the
+                                            input or output file */
+
+    endbuf = buf + strlen(buf);
+
+    tok->infile = NULL;
+    tok->outfile = NULL;
+
+    /* Build the argv list */
+    parsing_state = ST_NORMAL;
+    tok->argc = 0;
+    tok->timed = 0;
+
+    while (buf < endbuf) {
+        /* Skip the white-spaces */
+        buf += strspn (buf, delims);
+        if (buf >= endbuf) break;
+
+        /* Check for I/O redirection specifiers */
+        if (*buf == '<') {
+            if (tok->infile) {
+                report_error("Error: Ambiguous I/O redirection\n", NULL);
+                return -1;
+            }
+            parsing_state |= ST_INFILE;
+            buf++;
+            continue;
+        }
+        if (*buf == '>') {
+            if (tok->outfile) {
+                report_error("Error: Ambiguous I/O redirection\n", NULL);
+                return -1;
+            }
+            parsing_state |= ST_OUTFILE;
+            buf ++;
+            continue;
+        }
+
+        /* 
+         * Find the end of the token. Quoted parts may contain white-space
+         * and may be glued to unquoted text, as in name="a b"; the quotes
+         * are removed by sliding the text down over them.
+         */
+        token = dst = buf;
+        quoted = 0;
+        spliced = *buf == ARR_MARKER || (*buf == '"' && buf[1] == ARR_MARKER);
+        if (parsing_state == ST_NORMAL)
+            literal = *buf == EXP_LITERAL || spliced;
+        while (*buf != '\0' && strchr(delims, *buf) == NULL) {
+            if (*buf == '\'' || *buf == '\"') {
+                quoted = 1;
+                quote = *buf++;
+                if ((close = quote_end(buf - 1)) == NULL) {
+                    sbuf[0] = quote;
+                    sbuf[1] = '\0';
+                    report_error("Error: unmatched ", sbuf, ".\n", NULL);
+                    return -1;
+                }
+                while (buf < close) {
+                    if (*buf == EXP_LITERAL)
+                        buf++;
+                    quoted |= strchr("{},", *buf) != NULL;
+                    lit[dst - token] = 1;
+                    *dst++ = *buf++;
+                }
+                buf = close + 1;
+            } else if (*buf == EXP_LITERAL && buf[1] != '\0') {
+                /* A character of a value: never syntax, nor a brace */
+                quoted |= strchr("{},", buf[1]) != NULL;
+                lit[dst - token] = 1;
+                *dst++ = buf[1];
+                buf += 2;
+            } else {
+                lit[dst - token] = 0;
+                *dst++ = *buf++;
+            }
+        }
+        next = buf;
+
+        /* Terminate the token */
+        *dst = '\0';
+        buf = token;
+
+        /* Record the token as either the next argument or the i/o file */
+        switch (parsing_state) {
+        case ST_NORMAL:
+            if (spliced) {
+                /* "${name[@]}": one argument per element, no splitting */
+                arr = &array_list[atoi(buf + 2)];
+                pos = 0;
+                while ((value = array_next(arr, &pos, &key)) != NULL) {
+                    if (tok->argc >= MAXARGS-1) {
+                        report_error("Error: too many arguments\n", NULL);
+                        return -1;
+                    }
+                    tok->lazy[tok->argc] = 0;
+                    tok->argv[tok->argc++] = buf[1] == 'k' ? key : value;
+                }
+                break;
+            }
+            if (tok->argc >= MAXARGS-1) {
+                report_error("Error: too many arguments\n", NULL);
+                return -1;
+            }
+            if (brace_init(&br, buf, lit) == 0
+                || (isassign(buf) && !isarrayassign(buf))) {
+                tok->lazy[tok->argc] = 0;
+                tok->argv[tok->argc++] = buf;
+                break;
+            }
+            if (isarrayassign(tok->argc ? tok->argv[0] : buf)) {
+                /* Quoted braces are lost with the quotes: keep which */
+                tok->lit[tok->argc] = NULL;
+                if (quoted) {
+                    n = dst - token;
+                    if (words->len + n > ARGBUF) {
+                        sprintf(sbuf, "%d", ARGBUF);
+                        report_error("Error: ", buf, " expands past ", sbuf,
+                                     " bytes of arguments\n", NULL);
+                        return -1;
+                    }
+                    tok->lit[tok->argc] = words->buf + words->len;
+                    memcpy(words->buf + words->len, lit, n);
+                    words->len += n;
+                }
+                tok->lazy[tok->argc] = 1;
+                tok->argv[tok->argc++] = buf;
+                break;
+            }
+            /* An ordinary command gets every word in argv */
+            while ((n = brace_next(&br, words->buf + words->len,
+                                   ARGBUF - words->len)) > 0) {
+                if (tok->argc >= MAXARGS-1) {
+                    sprintf(sbuf, "%lu words, more than the %d arguments allowed",
+                            brace_count(&br), MAXARGS - 1);
+                    report_error("Error: ", buf, " expands to ", sbuf, "\n", NULL);
+                    return -1;
+                }
+                tok->lazy[tok->argc] = 0;
+                tok->argv[tok->argc++] = words->buf + words->len;
+                words->len += strlen(words->buf + words->len) + 1;
+            }
+            if (n < 0) {
+                sprintf(sbuf, "%d", ARGBUF);
+                report_error("Error: ", buf, " expands past ", sbuf,
+                             " bytes of arguments\n", NULL);
+                return -1;
+            }
+            break;
+        case ST_INFILE:
+            tok->infile = buf;
+            break;
+        case ST_OUTFILE:
+            tok->outfile = buf;
+            break;
+        default:
+            report_error("Error: Ambiguous I/O redirection\n", NULL);
+            return -1;
+        }
+        parsing_state = ST_NORMAL;
+
+        buf = next + 1;
+    }
+
+    if (parsing_state != ST_NORMAL) {
+        report_error("Error: must provide file name for redirection\n", NULL);
+        return -1;
+    }
+
+    /* The argument list must end with a NULL pointer */
+    tok->argv[tok->argc] = NULL;
+
+    if (tok->argc == 0)  /* ignore blank line */
+        return 1;
+
+    /* time cmd: run cmd and report what it used */
+    if (tok->argc > 1 && !strcmp(tok->argv[0], "time")) {
+        tok->timed = 1;
+        memmove(tok->argv, tok->argv + 1, tok->argc * sizeof(char *));
+        memmove(tok->lazy, tok->lazy + 1, tok->argc - 1);
+        memmove(tok->lit, tok->lit + 1, (tok->argc - 1) * sizeof(char *));
+        tok->argc--;
+    }
+
+    if (!strcmp(tok->argv[0], "quit")) {                 /* quit command */
+        tok->builtins = BUILTIN_QUIT;
+    } else if (!strcmp(tok->argv[0], "jobs")) {          /* jobs command */
+        tok->builtins = BUILTIN_JOBS;
+    } else if (!strcmp(tok->argv[0], "bg")) {            /* bg command */
+        tok->builtins = BUILTIN_BG;
+    } else if (!strcmp(tok->argv[0], "fg")) {            /* fg command */
+        tok->builtins = BUILTIN_FG;
+    } else if (!strcmp(tok->argv[0], "let")) {           /* let command */
+        tok->builtins = BUILTIN_LET;
+    } else if (!strcmp(tok->argv[0], "declare")) {       /* declare command */
+        tok->builtins = BUILTIN_DECLARE;
+    } else if (!strcmp(tok->argv[0], "unset")) {         /* unset command */
+        tok->builtins = BUILTIN_UNSET;
+    } else if (!strcmp(tok->argv[0], "set")) {           /* set command */
+        tok->builtins = BUILTIN_SET;
+    } else if (!strcmp(tok->argv[0], "maxjobs")) {       /* maxjobs command */
+        tok->builtins = BUILTIN_MAXJOBS;
+    } else if (!strcmp(tok->argv[0], "stats")) {         /* stats command */
+        tok->builtins = BUILTIN_STATS;
+    } else if (!strcmp(tok->argv[0], "pools")) {         /* pools command */
+        tok->builtins = BUILTIN_POOLS;
+    } else if (!strcmp(tok->argv[0], "every")) {         /* every command */
+        tok->builtins = BUILTIN_EVERY;
+    } else if (!strcmp(tok->argv[0], "at")) {            /* at command */
+        tok->builtins = BUILTIN_AT;
+    } else if (!strcmp(tok->argv[0], "reclaim")) {       /* reclaim command */
+        tok->builtins = BUILTIN_RECLAIM;
+    } else {
+        tok->builtins = BUILTIN_NONE;
+    }
+
+    /* Should the job run in the background? */
+    if ((is_bg = (*tok->argv[tok->argc-1] == '&' && !literal)) != 0)
+        tok->argv[--tok->argc] = NULL;
+
+    return is_bg;
+}
+
+/* 
+ * parsepipeline - Parse a command line of the form
+ *
+ *                command [| command...] [&]
+ *
+ *     into pl, one cmdline_tokens per stage. '|' is an ordinary
+ *     character unless the pipeline option is on, as the reference
+ *     shell's traces echo it unquoted. The tokens point into pl->buf. Returns 1 for a BG job, 0 for a FG job and -1 if the
+ *     command line is incorrectly formatted.
+ */
+int 
+parsepipeline(const char *cmdline, struct pipeline_t *pl) 
+{
+    char *p, *q, *stage;
+    int is_bg = 0, last;
+
+    (void) strncpy(pl->buf, cmdline, MAXLINE);
+    pl->buf[MAXLINE-1] = '\0';
+    pl->nstages = 0;
+    pl->words.len = 0;
+
+    for (p = stage = pl->buf; ; p++) {
+        /* A '|' inside quotes or out of an expansion does not separate stages */
+        if (*p == EXP_LITERAL && p[1] != '\0') {
+            p++;
+            continue;
+        }
+        if ((*p == '\'' || *p == '\"') && (q = quote_end(p)) != NULL) {
+            p = q;
+            continue;
+        }
+        if ((*p != '|' || !pipelines) && *p != '\0')
+            continue;
+
+        last = (*p == '\0');
+        *p = '\0';
+        if (pl->nstages >= MAXSTAGES) {
+            report_error("Error: too many pipeline stages\n", NULL);
+            return -1;
+        }
+        if (is_bg) {
+            report_error("Error: & must end the command line\n", NULL);
+            return -1;
+        }
+        if ((is_bg = parsetokens(stage, &pl->stage[pl->nstages], &pl->words)) < 0)
+            return -1;
+        if (pl->nstages > 0 && pl->stage[pl->nstages].timed) {
+            /* The whole pipeline is timed, so only its first stage may ask */
+            report_error("Error: time must start the command line\n", NULL);
+            return -1;
+        }
+        if (pl->stage[pl->nstages++].argc == 0 && (pl->nstages > 1 || !last)) {
+            report_error("Error: empty command in pipeline\n", NULL);
+            return -1;
+        }
+        if (last)
+            break;
+        stage = p + 1;
+    }
+    return is_bg;
+}
+
+
+/*
+ * expandline - Expand $name, ${...} and $((expr)) in cmdline into the
+ *     buffer expanded, which must hold MAXLINE characters. Text inside
+ *     single quotes is copied unchanged. Every intermediate result is
+ *     built in that buffer or on the stack, so expansion never calls
+ *     malloc. Returns 0 on success, -1 after printing an error.
+ */
+int
+expandline(const char *cmdline, char *expanded)
+{
+    char *out = expanded;
+    int rc;
+
+    expand_protect = 1;
+    rc = expand_text(cmdline, cmdline + strlen(cmdline),
+                     &out, expanded + MAXLINE - 1);
+    expand_protect = 0;
+    if (rc < 0)
+        return -1;
+    *out = '\0';
+    return 0;
+}
+
+/* expand_put - Append n bytes of s at *outp, which may not pass end */
+static int 
+expand_put(char **outp, char *end, const char *s, size_t n)
+{
+    if (*outp + n > end) {
+        report_error("Error: command line too long after expansion\n", NULL);
+        return -1;
+    }
+    memcpy(*outp, s, n);
+    *outp += n;
+    return 0;
+}
+
+/* 
+ * expand_value - Append the value s of n bytes at *outp like expand_put,
+ *     but with its syntax characters marked if expand_protect is set
+ */
+static int 
+expand_value(char **outp, char *end, const char *s, size_t n)
+{
+    char mark = EXP_LITERAL;
+    size_t i, plain;
+
+    if (!expand_protect)
+        return expand_put(outp, end, s, n);
+    for (i = 0; i < n; i += plain) {
+        for (plain = 0; i + plain < n
+                 && !memchr(EXP_SPECIAL, s[i + plain], sizeof(EXP_SPECIAL) - 1); plain++)
+            ;
+        if (expand_put(outp, end, s + i, plain) < 0)
+            return -1;
+        if (i + plain < n) {
+            if (expand_put(outp, end, &mark, 1) < 0
+                || expand_put(outp, end, s + i + plain, 1) < 0)
+                return -1;
+            plain++;
+        }
+    }
+    return 0;
+}
+
+/* expand_namelen - Length of the variable name (or digit) starting at p */
+static size_t 
+expand_namelen(const char *p, const char *stop)
+{
+    const char *q = p;
+
+    if (q < stop && isdigit((unsigned char) *q))
+        return 1;
+    if (q < stop && (isalpha((unsigned char) *q) || *q == '_'))
+        for (q++; q < stop && (isalnum((unsigned char) *q) || *q == '_'); q++)
+            ;
+    return q - p;
+}
+
+/* 
+ * expand_text - Expand the text in [p, stop) and append it at *outp.
+ *     Returns 0 on success, -1 after printing an error.
+ */
+int 
+expand_text(const char *p, const char *stop, char **outp, char *end)
+{
+    const char *q, *start = p;
+    char name[MAXNAME];
+    char *value;
+    size_t n;
+    int in_dquote = 0, alone;
+
+    while (p < stop) {
+        if (*p == '\'' && !in_dquote) {
+            /* Copy a single-quoted string verbatim */
+            q = memchr(p + 1, '\'', stop - p - 1);
+            n = q ? (size_t) (q - p + 1) : (size_t) (stop - p);
+            if (expand_put(outp, end, p, n) < 0)
+                return -1;
+            p += n;
+            continue;
+        }
+        if (*p == '"')
+            in_dquote = !in_dquote;
+
+        if (*p != '$') {
+            if (expand_put(outp, end, p++, 1) < 0)
+                return -1;
+            continue;
+        }
+
+        if (p + 2 < stop && p[1] == '(' && p[2] == '(')
+            p = expand_arith(p, stop, outp, end);
+        else if (p + 1 < stop && p[1] == '{') {
+            /* Note whether ${...} starts a word, for "${name[@]}" */
+            if (p == start || isspace((unsigned char) p[-1]))
+                alone = 1;
+            else if (in_dquote && p[-1] == '"'
+                     && (p - 1 == start || isspace((unsigned char) p[-2])))
+                alone = 2;
+            else
+                alone = 0;
+            p = expand_param(p, stop, outp, end, alone);
+        }
+        else if ((n = expand_namelen(p + 1, stop)) > 0 && n < MAXNAME) {
+            /* Plain $name */
+            memcpy(name, p + 1, n);
+            name[n] = '\0';
+            value = getvar(name);
+            if (value && expand_value(outp, end, value, strlen(value)) < 0)
+                return -1;
+            p += n + 1;
+        }
+        else if (expand_put(outp, end, p++, 1) < 0) /* lone '$' */
+            return -1;
+
+        if (p == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+/* 
+ * expand_arith - Expand the $((expr)) at p. The expression text is
+ *     expanded first, so it may refer to $name. Returns a pointer just
+ *     past the closing "))", or NULL after printing an error.
+ */
+const char 
+*expand_arith(const char *p, const char *stop, char **outp, char *end)
+{
+    const char *close;
+    char inner[MAXLINE], *in = inner;
+    char num[32];
+    int depth = 0, protect = expand_protect, rc;
+    long long result;
+
+    /* Find the "))" matching this "$((" */
+    for (close = p + 3; close + 1 < stop; close++) {
+        if (*close == '(')
+            depth++;
+        else if (*close == ')' && depth > 0)
+            depth--;
+        else if (*close == ')' && close[1] == ')')
+            break;
+    }
+    if (close + 1 >= stop) {
+        report_error("Error: unmatched $((.\n", NULL);
+        return NULL;
+    }
+
+    /* The expression is parsed, so its values are not marked */
+    expand_protect = 0;
+    rc = expand_text(p + 3, close, &in, inner + MAXLINE - 1);
+    expand_protect = protect;
+    if (rc < 0)
+        return NULL;
+    *in = '\0';
+    if (arith_eval(inner, &result) < 0)
+        return NULL;
+
+    sprintf(num, "%lld", result);
+    if (expand_put(outp, end, num, strlen(num)) < 0)
+        return NULL;
+    return close + 2;
+}
+
+/* 
+ * expand_array - Expand a whole array: what is '@' or '*' for the
+ *     values, 'k' for ${!name[@]} and '#' for ${#name[@]}. When
+ *     "${name[@]}" or ${name[@]} makes up a whole word, an ARR_MARKER
+ *     is written instead so that parseline can put the elements in argv
+ *     without splitting them again. Returns a pointer just past close.
+ */
+const char 
+*expand_array(const char *name, int what, int alone, const char *close,
+              const char *stop, char **outp, char *end)
+{
+    struct array_t *arr;
+    size_t pos = 0;
+    char *value, *key;
+    char num[32];
+    int first = 1, whole;
+
+    if ((arr = getarray(name)) == NULL) {
+        /* A plain variable is a one-element array */
+        value = getvar(name);
+        if (what == '#')
+            value = value ? "1" : "0";
+        else if (what == 'k')
+            value = value ? "0" : NULL;
+        if (value && expand_value(outp, end, value, strlen(value)) < 0)
+            return NULL;
+        return close + 1;
+    }
+
+    if (what == '#') {
+        sprintf(num, "%lu", (unsigned long) arr->count);
+        return expand_put(outp, end, num, strlen(num)) < 0 ? NULL : close + 1;
+    }
+
+    /* Indexes of an indexed array are plain numbers and need no marker */
+    whole = (alone == 1 && (close + 1 == stop || isspace((unsigned char) close[1])))
+        || (alone == 2 && close + 1 < stop && close[1] == '"'
+            && (close + 2 == stop || isspace((unsigned char) close[2])));
+    if (whole && expand_protect && (what == '@' || (what == 'k' && arr->kind == ARR_ASSOC))) {
+        sprintf(num, "%c%c%d", ARR_MARKER, what == 'k' ? 'k' : 'v',
+                (int) (arr - array_list));
+        return expand_put(outp, end, num, strlen(num)) < 0 ? NULL : close + 1;
+    }
+
+    /* Otherwise join the elements with spaces */
+    while ((value = array_next(arr, &pos, &key)) != NULL) {
+        if (!first && expand_put(outp, end, " ", 1) < 0)
+            return NULL;
+        first = 0;
+        if (what == 'k' && key == NULL) {
+            sprintf(num, "%lu", (unsigned long) pos - 1);
+            value = num;
+        }
+        else if (what == 'k')
+            value = key;
+        if (expand_value(outp, end, value, strlen(value)) < 0)
+            return NULL;
+    }
+    return close + 1;
+}
+
+/* 
+ * expand_word - Expand [p, stop) into the buffer buf of MAXLINE
+ *     characters, for use as a pattern, replacement or offset.
+ */
+static int 
+expand_word(const char *p, const char *stop, char *buf)
+{
+    char *out = buf;
+    int protect = expand_protect, rc;
+
+    /* Patterns and numbers are parsed again, so values are not marked */
+    expand_protect = 0;
+    rc = expand_text(p, stop, &out, buf + MAXLINE - 1);
+    expand_protect = protect;
+    if (rc < 0)
+        return -1;
+    *out = '\0';
+    return 0;
+}
+
+/* expand_number - Evaluate the arithmetic expression in [p, stop) */
+static int 
+expand_number(const char *p, const char *stop, long long *result)
+{
+    char buf[MAXLINE];
+
+    if (expand_word(p, stop, buf) < 0)
+        return -1;
+    return arith_eval(buf, result);
+}
+
+/* 
+ * expand_param - Expand the ${...} at p. Supported forms are
+ *
+ *     ${name}  ${name:-word}  ${#name}  ${name:off}  ${name:off:len}
+ *     ${name#pat}  ${name##pat}  ${name%pat}  ${name%%pat}
+ *     ${name/pat/rep}  ${name//pat/rep}
+ *
+ *     where name may also be an array element name[sub]. The whole-array
+ *     forms ${name[@]}, ${name[*]}, ${#name[@]} and ${!name[@]} are
+ *     handled by expand_array. alone is 1 if ${ starts an unquoted word
+ *     and 2 if it directly follows an opening double quote. Returns a
+ *     pointer just past the closing brace, or NULL after printing an
+ *     error.
+ */
+const char 
+*expand_param(const char *p, const char *stop, char **outp, char *end, int alone)
+{
+    const char *close, *q, *sep, *rb;
+    const char *match;
+    char *value;
+    char name[MAXNAME], sub[MAXLINE], word[MAXLINE], rep[MAXLINE], num[32];
+    char *out;
+    const struct pattern_t *pat;
+    struct array_t *arr;
+    size_t n, len, i, j;
+    int depth = 0, length = 0, keys = 0, all, longest;
+    long long off, cnt;
+
+    /* Find the '}' matching this "${" */
+    for (close = p + 2; close < stop; close++) {
+        if (*close == '{')
+            depth++;
+        else if (*close == '}' && depth-- == 0)
+            break;
+    }
+    if (close >= stop) {
+        report_error("Error: unmatched ${.\n", NULL);
+        return NULL;
+    }
+
+    q = p + 2;
+    if (*q == '#' && q + 1 < close) {  /* ${#name} */
+        length = 1;
+        q++;
+    }
+    else if (*q == '!' && q + 1 < close) {  /* ${!name[@]} */
+        keys = 1;
+        q++;
+    }
+    if ((n = expand_namelen(q, close)) == 0 || n >= MAXNAME)
+        goto bad;
+    memcpy(name, q, n);
+    name[n] = '\0';
+    q += n;
+
+    if (*q == '[') {  /* an array subscript */
+        if ((rb = memchr(q, ']', close - q)) == NULL)
+            goto bad;
+        if (rb == q + 2 && (q[1] == '@' || q[1] == '*')) {
+            if (rb + 1 != close)
+                goto bad;
+            return expand_array(name, keys ? 'k' : length ? '#' : q[1], alone,
+                                close, stop, outp, end);
+        }
+        if (expand_word(q + 1, rb, sub) < 0)
+            return NULL;
+        q = rb + 1;
+        if ((arr = getarray(name)) != NULL) {
+            if (array_lookup(arr, sub, &value) < 0)
+                return NULL;
+        }
+        else  /* a plain variable is a one-element array */
+            value = strcmp(sub, "0") ? NULL : getvar(name);
+    }
+    else
+        value = getvar(name);
+    if (keys)
+        goto bad;
+    if (value == NULL)
+        value = "";
+    len = strlen(value);
+
+    if (length) {
+        if (q != close)
+            goto bad;
+        sprintf(num, "%lu", (unsigned long) len);
+        return expand_put(outp, end, num, strlen(num)) < 0 ? NULL : close + 1;
+    }
+
+    if (q == close)  /* ${name} */
+        return expand_value(outp, end, value, len) < 0 ? NULL : close + 1;
+
+    if (q[0] == ':' && q[1] == '-') {  /* ${name:-word} */
+        if (len > 0)
+            return expand_value(outp, end, value, len) < 0 ? NULL : close + 1;
+        return expand_text(q + 2, close, outp, end) < 0 ? NULL : close + 1;
+    }
+
+    if (q[0] == ':') {  /* ${name:off} and ${name:off:len} */
+        sep = memchr(q + 1, ':', close - q - 1);
+        if (expand_number(q + 1, sep ? sep : close, &off) < 0)
+            return NULL;
+        if (off < 0)
+            off = (long long) len + off < 0 ? 0 : (long long) len + off;
+        if (off > (long long) len)
+            off = len;
+        cnt = len - off;
+        if (sep) {
+            if (expand_number(sep + 1, close, &cnt) < 0)
+                return NULL;
+            if (cnt < 0)  /* negative length counts back from the end */
+                cnt = (long long) len + cnt - off;
+            if (cnt < 0) {
+                report_error("Error: ", name, ": substring expression < 0\n", NULL);
+                return NULL;
+            }
+            if (cnt > (long long) len - off)
+                cnt = len - off;
+        }
+        return expand_value(outp, end, value + off, cnt) < 0 ? NULL : close + 1;
+    }
+
+    if (q[0] == '#' || q[0] == '%') {  /* prefix and suffix removal */
+        longest = q[1] == q[0];
+        if (expand_word(q + 1 + longest, close, word) < 0)
+            return NULL;
+        if ((pat = pattern_cached(word)) == NULL)
+            goto bad;
+        i = 0;
+        j = len;
+        for (n = 0; n <= len; n++) {
+            /* n is the length of the candidate prefix or suffix */
+            size_t k = longest ? len - n : n;
+
+            if (q[0] == '#' && pattern_match(pat, value, k)) {
+                i = k;
+                break;
+            }
+            if (q[0] == '%' && pattern_match(pat, value + len - k, k)) {
+                j = len - k;
+                break;
+            }
+        }
+        return expand_value(outp, end, value + i, j - i) < 0 ? NULL : close + 1;
+    }
+
+    if (q[0] == '/') {  /* ${name/pat/rep} and ${name//pat/rep} */
+        all = q[1] == '/';
+        q += 1 + all;
+        for (sep = q; sep < close && *sep != '/'; sep++)
+            if (*sep == '\\' && sep + 1 < close)
+                sep++;
+        if (expand_word(q, sep, word) < 0)
+            return NULL;
+        /* Like the word of ${name:-word}, values in rep stay marked */
+        out = rep;
+        if (sep < close && expand_text(sep + 1, close, &out, rep + MAXLINE - 1) < 0)
+            return NULL;
+        *out = '\0';
+        if ((pat = pattern_cached(word)) == NULL)
+            goto bad;
+
+        match = value;
+        for (i = 0; i < len; ) {
+            /* Longest non-empty match starting at i */
+            for (j = len; j > i; j--)
+                if (pattern_match(pat, value + i, j - i))
+                    break;
+            if (j == i) {
+                i++;
+                continue;
+            }
+            /* rep is text of the command line, quotes and all */
+            if (expand_value(outp, end, match, value + i - match) < 0
+                || expand_put(outp, end, rep, strlen(rep)) < 0)
+                return NULL;
+            match = value + j;
+            i = j;
+            if (!all)
+                break;
+        }
+        return expand_value(outp, end, match, value + len - match) < 0 ? NULL : close + 1;
+    }
+
+ bad:
+    snprintf(sbuf, MAXLINE, "%.*s", (int) (close - p + 1), p);
+    report_error("Error: ", sbuf, ": bad substitution\n", NULL);
+    return NULL;
+}
+
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP, SIGTSTP, SIGTTIN or SIGTTOU signal. The 
+ *     handler reaps all available zombie children, but doesn't wait 
+ *     for any other currently running children to terminate.  
+ */
+void 
+sigchld_handler(int sig) 
+{
+    /* Declare variables */
+    int olderrno = errno, status, i;
+    sigset_t mask_all, prev;
+    pid_t pid;
+    struct job_t *job;
+    struct rusage ru;
+
+    /* Initialize block sets */
+    Sigfillset(&mask_all);
+
+    /* Parent reaps zombie child */
+    while((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &ru))>0)
+    {
+        Sigprocmask(SIG_BLOCK, &mask_all, &prev); /* Block all signals */
+        if((job = getjobproc(job_list, pid)) == NULL) /* Not in a job */
+        {
+            Sigprocmask(SIG_SETMASK, &prev, NULL);
+            continue;
+        }
+
+        if(WIFSTOPPED(status)) /* Child is stopped */
+        {
+            /* 
+            * If child stopped by SIGTSTP from shell, then 
+            * sigtstp_handler will deal with it. However, if 
+            * it was stopped by a signal didn't caught by shell, 
+            * then sigchld_handler should change the state 
+            * and print message. If child's state did not 
+            * change, it is because of a signal didn't caught
+            * by shell. One example is trace 12, where the child
+            * send itself SIGTSTP. In this case, handler should 
+            * change the state and print prompt message.
+            */
+            if(job->state != ST) 
+            {
+                if(human())
+                {
+                    sio_puts("Job [");
+                    sio_putl(job->jid);
+                    sio_puts("] (");
+                    sio_putl(job->pid);
+                    sio_puts(") stopped by signal ");
+                    sio_putl(WSTOPSIG(status));
+                    sio_puts("\n");
+                }
+                job->state = ST;
+                notice("stop", job, "signal", WSTOPSIG(status));
+            }
+            job->stopped = 1;
+            job->stop_ms = now_ms();
+            reclaim_due = 1;
+        }
+        else /* Child terminated */
+        {
+            /* 
+            * A pipeline job ends when its last process is reaped,
+            * and like other shells we report how its last stage
+            * ended, not a SIGPIPE in the middle. If the last stage
+            * was a builtin, no process speaks for the job.
+            */
+            for(i = 0; job->pids[i] != pid; i++)
+                ;
+            job->pids[i] = 0;
+            job->nlive--;
+            perf_reap(job, i, &ru);
+            if(WIFSIGNALED(status) && i == job->laststage)
+                job->termsig = WTERMSIG(status);
+            if(WIFEXITED(status) && i == job->laststage)
+                job->exitstatus = WEXITSTATUS(status);
+
+            if(job->nlive == 0)
+            {
+                if(job->termsig)
+                    notice("exit", job, "signal", job->termsig);
+                else
+                    notice("exit", job, "status", job->exitstatus);
+                if(job->termsig && human()) /* Child terminated by a signal */
+                {
+                    /* Print prompt message */
+                    sio_puts("Job ["  );
+                    sio_putl(job->jid);
+                    sio_puts("] (");
+                    sio_putl(job->pid);
+                    sio_puts(") terminated by signal ");
+                    sio_putl(job->termsig);
+                    sio_puts("\n");
+                }
+                /* Learn how long it took, unless it was cut short */
+                if(!job->termsig && !job->stopped)
+                    stats_record(job);
+                job->run.real_ms = now_ms() - job->start_ms;
+                lastrun = job->run;
+                lastrun_pgid = job->pid;
+                pool_release(job);
+                /* Delete job */
+                deletejob(job_list, job->pid);
+                dispatch_jobs(); /* A slot is free */
+            }
+        }
+
+        /* Unblock signals */
+        Sigprocmask(SIG_SETMASK, &prev, NULL);
+    }
+
+    errno = olderrno;
+
+    return;
+}
+
+/* 
+ * sigint_handler - The kernel sends a SIGINT to the shell whenver the
+ *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    to the foreground job.  
+ */
+void 
+sigint_handler(int sig) 
+{
+    /* Declare and initialize variables */
+    int olderrno = errno, i;
+    sigset_t mask_all, prev;
+    pid_t pid;
+    pid = fgpid(job_list);
+    Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev); /* Block all signals */
+
+    if(!pid) /* A foreground job may still wait for its pool */
+        for(i = 0; i < MAXJOBS; i++)
+            if(job_list[i].state == QU && job_list[i].qstate == FG)
+                pid = job_list[i].pid;
+    if(pid) /* If foreground job exist */
+    {
+        kill(-pid, sig);
+        record_event("SIGINT", 1);
+    }
+    /* 
+    * Since the shell will wait foreground job terminate,
+    * so we just let sigchld_handler to delete jobs and
+    * print message
+    */
+    Sigprocmask(SIG_SETMASK, &prev, NULL); /* Unblock signals */
+
+    errno = olderrno;
+
+    return;
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     the user types ctrl-z at the keyboard. Catch it and suspend the
+ *     foreground job by sending it a SIGTSTP.  
+ */
+void 
+sigtstp_handler(int sig) 
+{
+    /* Declare and initialize variables */
+    int olderrno = errno, jid;
+    sigset_t mask_all, prev;
+    pid_t pid;
+    struct job_t *job;
+    pid = fgpid(job_list); /* Get foreground job's pid */
+    jid = pid2jid(pid); /* Get foreground job's jid */
+    job = getjobpid(job_list,pid); /* Get job */
+    Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev);
+    
+    if(pid && job->cgid && freezer_write(job, 1) == 0)
+    {
+        /* Frozen, not stopped: freezer_run sees the freeze through */
+        job->freezing = 1;
+        record_event("SIGTSTP", 1);
+    }
+    else if(pid) /* If foreground job exist */
+    {
+        /* 
+        * The shell will wait foreground job terminate,
+        * so we must print message and change the state
+        * here. As for child stopped for other reasons,
+        * we leave the job for sigchld_handler.
+        */
+        if(human())
+        {
+            sio_puts("Job [");
+            sio_putl(jid);
+            sio_puts("] (");
+            sio_putl(pid);
+            sio_puts(") stopped by signal ");
+            sio_putl(sig);
+            sio_puts("\n");
+        }
+        job->state = ST;
+        notice("stop", job, "signal", sig);
+        job->stopped = 1;
+        /* Send signals */
+        kill(-pid, sig);
+        record_event("SIGTSTP", 1);
+        
+    }
+    Sigprocmask(SIG_SETMASK, &prev, NULL); /* Unblock signals */
+
+    errno = olderrno;
+    
+    return;
+}
+
+/*
+ * sigalrm_handler - pool_waker sends SIGALRM when a slot a queued job
+ *     waits for may have been given back. Try again.
+ */
+void 
+sigalrm_handler(int sig) 
 {
-    /* Declare and initialize variables */
     int olderrno = errno;
     sigset_t mask_all, prev;
+
+    Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev);
+    dispatch_jobs();
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+    errno = olderrno;
+}
+
+/*
+ * sigquit_handler - The driver program can gracefully terminate the
+ *    child shell by sending it a SIGQUIT signal.
+ */
+void 
+sigquit_handler(int sig) 
+{
+    sio_error("Terminating after receipt of SIGQUIT signal\n");
+}
+
+
+
+/*********************
+ * End signal handlers
+ *********************/
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/* clearjob - Clear the entries in a job struct */
+void 
+clearjob(struct job_t *job) {
+    char name[24];
+    int i, k;
+
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->cmdline[0] = '\0';
+    job->nprocs = 0;
+    job->nlive = 0;
+    job->termsig = 0;
+    job->stopped = 0;
+    job->statkey = 0;
+    if (job->holdfd >= 0)
+        close(job->holdfd);
+    job->holdfd = -1;
+    job->pool = -1;
+    job->poolslot = -1;
+    job->stop_ms = 0;
+    job->reclaim_ms = 0;
+    if (job->eventsfd >= 0)
+        close(job->eventsfd);
+    job->eventsfd = -1;
+    job->freezing = 0;
+    if (job->cgid) {  /* Fails if a process of the job lives on */
+        sio_ltoa(job->cgid, name, 10);
+        unlinkat(freezerfd, name, AT_REMOVEDIR);
+    }
+    job->cgid = 0;
+    for (i = 0; i < MAXSTAGES; i++)
+        for (k = 0; k < NPERF; k++) {
+            if (job->perffd[i][k] >= 0)
+                close(job->perffd[i][k]);
+            job->perffd[i][k] = -1;
+        }
+    for (k = 0; k < NPERF; k++)
+        job->run.count[k] = -1;
+    job->run.utime_us = job->run.stime_us = job->run.real_ms = 0;
+}
+
+/* initjobs - Initialize the job list */
+void 
+initjobs(struct job_t *job_list) {
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++) {
+        job_list[i].holdfd = -1;
+        job_list[i].eventsfd = -1;
+        memset(job_list[i].perffd, 0xff, sizeof(job_list[i].perffd));
+        clearjob(&job_list[i]);
+    }
+}
+
+/* maxjid - Returns largest allocated job ID */
+int 
+maxjid(struct job_t *job_list) 
+{
+    int i, max=0;
+
+    for (i = 0; i < MAXJOBS; i++)
+        if (job_list[i].jid > max)
+            max = job_list[i].jid;
+    return max;
+}
+
+/* addjob - Add a job to the job list */
+int 
+addjob(struct job_t *job_list, pid_t pid, int state, char *cmdline) 
+{
+    int i;
+
+    if (pid < 1)
+        return 0;
+
+    for (i = 0; i < MAXJOBS; i++) {
+        if (job_list[i].pid == 0) {
+            job_list[i].pid = pid;
+            job_list[i].state = state;
+            job_list[i].jid = nextjid++;
+            job_list[i].pids[0] = pid;
+            job_list[i].nprocs = 1;
+            job_list[i].nlive = 1;
+            job_list[i].laststage = 0;
+            job_list[i].termsig = 0;
+            job_list[i].exitstatus = 0;
+            job_list[i].start_ms = now_ms();
+            job_list[i].qstate = state == QU ? BG : state;
+            if (nextjid > MAXJOBS)
+                nextjid = 1;
+            strcpy(job_list[i].cmdline, cmdline);
+            if(verbose){
+                printf("Added job [%d] %d %s\n",
+                       job_list[i].jid,
+                       job_list[i].pid,
+                       job_list[i].cmdline);
+            }
+            return 1;
+        }
+    }
+    printf("Tried to create too many jobs\n");
+    return 0;
+}
+
+/* deletejob - Delete a job whose PID=pid from the job list */
+int 
+deletejob(struct job_t *job_list, pid_t pid) 
+{
+    int i;
+
+    if (pid < 1)
+        return 0;
+
+    for (i = 0; i < MAXJOBS; i++) {
+        if (job_list[i].pid == pid) {
+            clearjob(&job_list[i]);
+            nextjid = maxjid(job_list)+1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t 
+fgpid(struct job_t *job_list) {
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+        if (job_list[i].state == FG)
+            return job_list[i].pid;
+    return 0;
+}
+
+/* getjobpid  - Find a job (by PID) on the job list */
+struct job_t 
+*getjobpid(struct job_t *job_list, pid_t pid) {
+    int i;
+
+    if (pid < 1)
+        return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+        if (job_list[i].pid == pid)
+            return &job_list[i];
+    return NULL;
+}
+
+/* getjobproc - Find the job that process pid belongs to */
+struct job_t 
+*getjobproc(struct job_t *job_list, pid_t pid) {
+    int i, j;
+
+    if (pid < 1)
+        return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+        for (j = 0; j < job_list[i].nprocs; j++)
+            if (job_list[i].pids[j] == pid)
+                return &job_list[i];
+    return NULL;
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct job_t *job_list, int jid) 
+{
+    int i;
+
+    if (jid < 1)
+        return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+        if (job_list[i].jid == jid)
+            return &job_list[i];
+    return NULL;
+}
+
+/* pid2jid - Map process ID to job ID */
+int 
+pid2jid(pid_t pid) 
+{
+    int i;
+
+    if (pid < 1)
+        return 0;
+    for (i = 0; i < MAXJOBS; i++)
+        if (job_list[i].pid == pid) {
+            return job_list[i].jid;
+        }
+    return 0;
+}
+
+/* listjobs - Print the job list */
+void 
+listjobs(struct job_t *job_list, int output_fd) 
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+        if (job_list[i].pid != 0)
+            listjob(&job_list[i], i, output_fd);
+    listtimers(output_fd);
+}
+
+/* listjob - Print entry i of the job list */
+void 
+listjob(struct job_t *job, int i, int output_fd) 
+{
+    char buf[MAXLINE + 1];
+
+    memset(buf, '\0', MAXLINE);
+    sprintf(buf, "[%d] (%d) ", job->jid, job->pid);
+    if(write(output_fd, buf, strlen(buf)) < 0) {
+        fprintf(stderr, "Error writing to output file\n");
+        exit(1);
+    }
+    memset(buf, '\0', MAXLINE);
+    switch (job->state) {
+    case BG:
+        sprintf(buf, "Running    ");
+        break;
+    case FG:
+        sprintf(buf, "Foreground ");
+        break;
+    case ST:
+        sprintf(buf, "Stopped    ");
+        break;
+    case QU:
+        sprintf(buf, "Queued     ");
+        break;
+    default:
+        sprintf(buf, "listjobs: Internal error: job[%d].state=%d ",
+                i, job->state);
+    }
+    if(write(output_fd, buf, strlen(buf)) < 0) {
+        fprintf(stderr, "Error writing to output file\n");
+        exit(1);
+    }
+    memset(buf, '\0', MAXLINE);
+    sprintf(buf, "%s\n", job->cmdline);
+    if(write(output_fd, buf, strlen(buf)) < 0) {
+        fprintf(stderr, "Error writing to output file\n");
+        exit(1);
+    }
+}
+
+/* 
+ * listjobs_long - Print the job list, and under each job how long it
+ *     has run and how long it is expected to take
+ */
+void 
+listjobs_long(struct job_t *job_list, int output_fd) 
+{
+    struct runstats_t run;
+    char buf[MAXLINE];
+    long expect, elapsed;
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++) {
+        if (job_list[i].pid == 0)
+            continue;
+        listjob(&job_list[i], i, output_fd);
+        expect = stats_predict(&job_list[i]);
+        elapsed = job_list[i].state == QU ? 0 : now_ms() - job_list[i].start_ms;
+        if (expect < 0)
+            sprintf(buf, "    elapsed %ld ms, no history\n", elapsed);
+        else
+            sprintf(buf, "    elapsed %ld ms, expected %ld ms, remaining %ld ms\n",
+                    elapsed, expect, expect > elapsed ? expect - elapsed : 0);
+        if (job_list[i].pool >= 0)
+            sprintf(buf + strlen(buf), "    pool %s, %s\n",
+                    poolfile->pool[job_list[i].pool].name,
+                    job_list[i].poolslot >= 0 ? "holds a slot" : "waiting for a slot");
+        if (job_list[i].reclaim_ms && reclaim_stats[i].pgid == job_list[i].pid)
+            sprintf(buf + strlen(buf), "    reclaimed %ld kB%s%s\n",
+                    reclaim_stats[i].bytes / 1024,
+                    reclaim_stats[i].err ? ", last attempt failed: " : "",
+                    reclaim_stats[i].err ? strerror(reclaim_stats[i].err) : "");
+        if (write(output_fd, buf, strlen(buf)) < 0) {
+            fprintf(stderr, "Error writing to output file\n");
+            exit(1);
+        }
+        if (job_runstats(&job_list[i], &run))
+            runstats_print(&run, output_fd, "    ", 0);
+    }
+    listtimers(output_fd);
+}
+
+/* 
+ * listtimers - Print the timers of every and at, with when they fire
+ *     next
+ */
+void 
+listtimers(int output_fd) 
+{
+    static const char *policies[] = {"skip", "queue", "kill"};
+    struct wtimer_t *t;
+    char buf[MAXLINE + 128];
+    long next;
+    int i;
+
+    for (i = 0; i < MAXTIMERS; i++) {
+        t = &timer_list[i];
+        if (!t->used)
+            continue;
+        next = timer_next_ms(t);
+        if (t->interval)
+            sprintf(buf, "[T%d] Every %ldms, next in %ld.%03lds (%s, %d runs, %d skipped) %s\n",
+                    t->id, (long) t->interval * TICK_MS, next / 1000, next % 1000,
+                    policies[t->policy], t->runs, t->skipped, t->cmdline);
+        else if (t->pending)
+            sprintf(buf, "[T%d] At, after the last run %s\n", t->id, t->cmdline);
+        else
+            sprintf(buf, "[T%d] At, next in %ld.%03lds %s\n",
+                    t->id, next / 1000, next % 1000, t->cmdline);
+        if (write(output_fd, buf, strlen(buf)) < 0) {
+            fprintf(stderr, "Error writing to output file\n");
+            exit(1);
+        }
+    }
+}
+
+/* 
+ * listjobs_json - Print the job list as "job" JSON lines, with run
+ *     times if detail is set
+ */
+void 
+listjobs_json(struct job_t *job_list, int fd, int detail) 
+{
+    struct jw_t w;
+    struct runstats_t run;
+    sigset_t mask_all, prev;
+    long expect;
+    int i;
+
+    /* Keep notices from the signal handlers out of the middle of a line */
+    Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev);
+    for (i = 0; i < MAXJOBS; i++) {
+        if (job_list[i].pid == 0)
+            continue;
+        jw_begin(&w, fd, "job");
+        jw_int(&w, "jid", job_list[i].jid);
+        jw_int(&w, "pid", job_list[i].pid);
+        jw_str(&w, "state", state_name(job_list[i].state));
+        jw_str(&w, "cmdline", job_list[i].cmdline);
+        if (detail) {
+            jw_int(&w, "elapsed_ms", job_list[i].state == QU ? 0
+                   : now_ms() - job_list[i].start_ms);
+            if ((expect = stats_predict(&job_list[i])) >= 0)
+                jw_int(&w, "expected_ms", expect);
+            if (job_list[i].pool >= 0) {
+                jw_str(&w, "pool", poolfile->pool[job_list[i].pool].name);
+                jw_int(&w, "poolslot", job_list[i].poolslot);
+            }
+            if (job_list[i].reclaim_ms && reclaim_stats[i].pgid == job_list[i].pid) {
+                jw_int(&w, "reclaimed_bytes", reclaim_stats[i].bytes);
+                if (reclaim_stats[i].err)
+                    jw_str(&w, "reclaim_error", strerror(reclaim_stats[i].err));
+            }
+            if (job_runstats(&job_list[i], &run))
+                runstats_json(&w, &run, 0);
+        }
+        jw_end(&w);
+    }
+    for (i = 0; i < MAXTIMERS; i++) {
+        if (!timer_list[i].used)
+            continue;
+        jw_begin(&w, fd, "timer");
+        jw_int(&w, "id", timer_list[i].id);
+        jw_str(&w, "kind", timer_list[i].interval ? "every" : "at");
+        if (timer_list[i].interval) {
+            jw_int(&w, "interval_ms", (long) timer_list[i].interval * TICK_MS);
+            jw_str(&w, "policy", timer_list[i].policy == OVL_SKIP ? "skip"
+                   : timer_list[i].policy == OVL_QUEUE ? "queue" : "kill");
+        }
+        jw_int(&w, "next_ms", timer_next_ms(&timer_list[i]));
+        jw_int(&w, "runs", timer_list[i].runs);
+        jw_int(&w, "skipped", timer_list[i].skipped);
+        jw_str(&w, "cmdline", timer_list[i].cmdline);
+        jw_end(&w);
+    }
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+/******************************
+ * end job list helper routines
+ ******************************/
+
+/***********************************************
+ * Job scheduling routines
+ **********************************************/
+
+/* now_ms - Monotonic time in milliseconds, safe in signal handlers */
+long 
+now_ms(void) 
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* 
+ * stats_open - Map the runtime statistics file, $TSH_STATS or
+ *     ~/.tsh_stats. If it cannot be mapped, statistics are kept in
+ *     memory for this session only.
+ */
+void 
+stats_open(void) 
+{
+    char path[MAXLINE];
+    char *env;
+    int fd = -1;
+    struct stat sb;
+    void *map = MAP_FAILED;
+
+    if ((env = getenv("TSH_STATS")) != NULL)
+        snprintf(path, MAXLINE, "%s", env);
+    else if ((env = getenv("HOME")) != NULL)
+        snprintf(path, MAXLINE, "%s/.tsh_stats", env);
+    else
+        path[0] = '\0';
+
+    if (path[0] != '\0' && (fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) >= 0) {
+        /* A file of the wrong size is from another version; start over */
+        if (fstat(fd, &sb) == 0 && sb.st_size != sizeof(struct statsfile_t))
+            if (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(struct statsfile_t)) < 0)
+                sb.st_size = -1;
+        if (sb.st_size >= 0)
+            map = mmap(NULL, sizeof(struct statsfile_t), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    if (map == MAP_FAILED) {
+        if (verbose)
+            printf("stats_open: %s: not persistent\n", path);
+        map = Calloc(1, sizeof(struct statsfile_t));
+    }
+    statsfile = map;
+    if (memcmp(statsfile->magic, STATS_MAGIC, sizeof(statsfile->magic))) {
+        memset(statsfile, 0, sizeof(struct statsfile_t));
+        memcpy(statsfile->magic, STATS_MAGIC, sizeof(statsfile->magic));
+    }
+}
+
+/* 
+ * stats_setkey - Set the statistics keys of a new job: the last path
+ *     component of its first command, and a hash of that and every word
+ *     of every stage. Leading name=value words are not the command.
+ */
+void 
+stats_setkey(struct job_t *job, struct pipeline_t *pl) 
+{
+    unsigned long hash = 14695981039346656037ul;  /* FNV-1a */
+    struct cmdline_tokens *tok;
+    char *name, *p;
+    int i, j, cmd;
+
+    tok = &pl->stage[0];
+    for (cmd = 0; cmd < tok->argc - 1 && isassign(tok->argv[cmd]); cmd++)
+        ;
+    name = tok->argv[cmd];
+    if ((p = strrchr(name, '/')) != NULL && p[1] != '\0')
+        name = p + 1;
+    snprintf(job->cmdname, MAXCMDNAME, "%s", name);
+
+    for (p = job->cmdname; *p; p++)
+        hash = (hash ^ (unsigned char) *p) * 1099511628211ul;
+    job->namekey = hash ? hash : 1;
+
+    for (i = 0; i < pl->nstages; i++) {
+        for (j = i ? 1 : cmd + 1; j < pl->stage[i].argc; j++) {
+            hash = (hash ^ ' ') * 1099511628211ul;
+            for (p = pl->stage[i].argv[j]; *p; p++)
+                hash = (hash ^ (unsigned char) *p) * 1099511628211ul;
+        }
+        hash = (hash ^ '|') * 1099511628211ul;
+    }
+    job->statkey = hash ? hash : 1;
+}
+
+/* 
+ * stats_read - Copy the entry st into copy. Returns false if another
+ *     shell was rewriting it, in which case the copy is not to be used.
+ */
+int 
+stats_read(struct cmdstat_t *st, struct cmdstat_t *copy) 
+{
+    unsigned int seq = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+
+    if (seq & 1)
+        return 0;
+    memcpy(copy, st, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&st->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/* 
+ * stats_record - Add the run time of a job that just finished. Called
+ *     from the SIGCHLD handler with all signals blocked. If another shell
+ *     is rewriting the entry, this run is left out rather than waited for.
+ */
+void 
+stats_record(struct job_t *job) 
+{
+    struct cmdstat_t *st, *victim = NULL, copy;
+    long elapsed = now_ms() - job->start_ms;
+    unsigned int seq, victim_runs = 0;
+    int i, n;
+
+    if (statsfile == NULL || job->statkey == 0)
+        return;
+
+    /* Linear probing over a short window; evict the least used entry */
+    for (i = 0; i < 8; i++) {
+        st = &statsfile->stats[(job->statkey + i) % MAXSTATS];
+        if (!stats_read(st, &copy))
+            continue;
+        if (copy.key == job->statkey)
+            break;
+        if (victim == NULL || copy.runs < victim_runs) {
+            victim = st;
+            victim_runs = copy.runs;
+        }
+        if (copy.key == 0)
+            break;
+    }
+    if (i == 8 && (st = victim) == NULL)
+        return;
+
+    seq = __atomic_load_n(&st->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&st->seq, &seq, seq + 1, 0,
+                                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    if (st->key != job->statkey) {  /* A new entry, or evicted meanwhile */
+        st->key = job->statkey;
+        st->namekey = job->namekey;
+        strncpy(st->name, job->cmdname, MAXCMDNAME);
+        st->runs = 0;
+        st->mean_ms = 0;
+    }
+
+    /* Running mean over the first runs, then an average that decays */
+    n = st->runs < 4 ? st->runs + 1 : 4;
+    st->mean_ms += (elapsed - (long) st->mean_ms) / n;
+    st->runs++;
+    __atomic_store_n(&st->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* 
+ * stats_predict - Expected run time of a job in ms. A command never
+ *     seen with these arguments is expected to take as long as its runs
+ *     with other arguments, or else as long as the average command.
+ *     Returns -1 if there is no history at all.
+ */
+long 
+stats_predict(struct job_t *job) 
+{
+    struct cmdstat_t st;
+    long name_sum = 0, all_sum = 0;
+    int i, name_n = 0, all_n = 0;
+
+    if (statsfile == NULL)
+        return -1;
+    for (i = 0; i < 8; i++) {
+        if (!stats_read(&statsfile->stats[(job->statkey + i) % MAXSTATS], &st))
+            continue;
+        if (st.key == job->statkey)
+            return st.mean_ms;
+        if (st.key == 0)
+            break;
+    }
+    for (i = 0; i < MAXSTATS; i++) {
+        if (!stats_read(&statsfile->stats[i], &st) || st.key == 0)
+            continue;
+        if (st.namekey == job->namekey) {
+            name_sum += st.mean_ms;
+            name_n++;
+        }
+        all_sum += st.mean_ms;
+        all_n++;
+    }
+    if (name_n)
+        return name_sum / name_n;
+    if (all_n)
+        return all_sum / all_n;
+    return -1;
+}
+
+/* running_jobs - Number of jobs that count against maxjobs */
+int 
+running_jobs(void) 
+{
+    int i, n = 0;
+
+    for (i = 0; i < MAXJOBS; i++)
+        if (job_list[i].state == FG || job_list[i].state == BG)
+            n++;
+    return n;
+}
+
+/* release_job - Let the processes of a queued job exec */
+void 
+release_job(struct job_t *job) 
+{
+    if (job->holdfd >= 0) {
+        close(job->holdfd);
+        job->holdfd = -1;
+        job->start_ms = now_ms();
+    }
+}
+
+/* 
+ * dispatch_jobs - Start queued jobs while fewer than maxjobs jobs are
+ *     running, the one expected to run longest first, as predicted when
+ *     it was queued. Jobs without any
+ *     history go after the others, in the order they were submitted.
+ *     A foreground job is not held back by maxjobs, and a job in a pool
+ *     is skipped until it gets a slot. Call with SIGCHLD blocked; it is
+ *     safe in a signal handler.
+ */
+void 
+dispatch_jobs(void) 
+{
+    struct job_t *best;
+    long best_ms, ms;
+    int i, tried[MAXJOBS] = {0}, waiting = 0;
+    unsigned int seen = 0;
+
+    /* Read first, so a slot given back during the pass is not missed */
+    if (poolfile != NULL)
+        seen = __atomic_load_n(&poolfile->released, __ATOMIC_ACQUIRE);
+
+    while (1) {
+        best = NULL;
+        best_ms = -2;
+        for (i = 0; i < MAXJOBS; i++) {
+            if (job_list[i].state != QU || tried[i])
+                continue;
+            ms = job_list[i].expect_ms;
+            if (ms > best_ms || (ms == best_ms && job_list[i].jid < best->jid)) {
+                best = &job_list[i];
+                best_ms = ms;
+            }
+        }
+        if (best == NULL)
+            break;
+        tried[best - job_list] = 1;
+        if (best->qstate == BG && maxjobs > 0 && running_jobs() >= maxjobs)
+            continue;
+        if (!pool_acquire(best)) {
+            waiting = 1;
+            continue;
+        }
+        release_job(best);
+        best->state = best->qstate;
+    }
+
+    /* Have pool_waker watch for a slot, or stop watching */
+    if (waiting) {
+        __atomic_store_n(&pool_seen, seen, __ATOMIC_RELAXED);
+        __atomic_store_n(&pool_waiting, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &pool_waiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+    else
+        __atomic_store_n(&pool_waiting, 0, __ATOMIC_RELAXED);
+}
+/******************************
+ * end job scheduling routines
+ ******************************/
+
+/***********************************************
+ * Host-wide pool routines
+ **********************************************/
+
+/* 
+ * proc_starttime - When process pid started, in clock ticks since boot,
+ *     or 0 if it has exited. Together with the PID it names a process that
+ *     has not been replaced by a later one. Safe in a signal handler.
+ */
+static unsigned long long 
+proc_starttime(pid_t pid) 
+{
+    char path[32] = "/proc/", digits[16], buf[1024], *p;
+    int fd, i = 0, n = 6, field;
+    ssize_t len;
+
+    do {
+        digits[i++] = '0' + pid % 10;
+    } while ((pid /= 10) > 0);
+    while (i > 0)
+        path[n++] = digits[--i];
+    strcpy(path + n, "/stat");
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+
+    /* Field 22; the command name in field 2 may hold spaces */
+    if ((p = strrchr(buf, ')')) == NULL || p[1] == '\0' || p[2] == 'Z')
+        return 0;           /* a zombie has exited too */
+    for (field = 2; field < 22 && p != NULL; field++)
+        p = strchr(p + 1, ' ');
+    return p == NULL ? 0 : strtoull(p + 1, NULL, 10);
+}
+
+/* 
+ * pool_waker - Thread that sleeps on the released futex while a job of
+ *     this shell waits for a slot, and sends the shell SIGALRM once a
+ *     slot is given back. Every POOLCHECK_MS it does so anyway, so slots
+ *     of shells that died without giving them back are found.
+ */
+static void *
+pool_waker(void *arg) 
+{
+    struct timespec check = {POOLCHECK_MS / 1000, POOLCHECK_MS % 1000 * 1000000};
+
+    for (;;) {
+        while (!__atomic_load_n(&pool_waiting, __ATOMIC_ACQUIRE))
+            syscall(SYS_futex, &pool_waiting, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+        syscall(SYS_futex, &poolfile->released, FUTEX_WAIT,
+                __atomic_load_n(&pool_seen, __ATOMIC_RELAXED), &check, NULL, 0);
+        /* dispatch_jobs sets pool_waiting again if it still has to wait */
+        if (__atomic_exchange_n(&pool_waiting, 0, __ATOMIC_ACQ_REL))
+            kill(getpid(), SIGALRM);
+    }
+    return arg;
+}
+
+/* 
+ * pools_open - Map the pools file, $TSH_POOLS or /dev/shm/tsh-pools.UID,
+ *     shared by all shells of the user on the host. Returns 0 on success.
+ *     A file for several users is theirs to create with the right mode.
+ */
+int 
+pools_open(void) 
+{
+    char *path, own[64];
+    struct stat sb;
+    sigset_t mask_all, prev;
+    pthread_t waker;
+    void *map;
+    int fd;
+
+    if (poolfile != NULL)
+        return 0;
+    if ((path = getenv("TSH_POOLS")) == NULL) {
+        snprintf(own, sizeof(own), "/dev/shm/tsh-pools.%d", (int) geteuid());
+        path = own;
+    }
+    if ((fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0) {
+        report_error("pools: ", path, ": ", strerror(errno), "\n", NULL);
+        return -1;
+    }
+    if (path == own && (fstat(fd, &sb) < 0 || sb.st_uid != geteuid())) {
+        report_error("pools: ", path, ": not owned by this user\n", NULL);
+        close(fd);
+        return -1;
+    }
+
+    /* The first shell to get here lays the file out */
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &sb) < 0 || (sb.st_size != sizeof(struct poolfile_t)
+                               && ftruncate(fd, sizeof(struct poolfile_t)) < 0)) {
+        report_error("pools: ", path, ": ", strerror(errno), "\n", NULL);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, sizeof(struct poolfile_t), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        report_error("pools: ", path, ": ", strerror(errno), "\n", NULL);
+        close(fd);
+        return -1;
+    }
+    poolfile = map;
+    if (memcmp(poolfile->magic, POOLS_MAGIC, sizeof(poolfile->magic))) {
+        memset(poolfile, 0, sizeof(struct poolfile_t));
+        memcpy(poolfile->magic, POOLS_MAGIC, sizeof(poolfile->magic));
+    }
+    flock(fd, LOCK_UN);
+    poolsfd = fd;
+    shell_start = proc_starttime(getpid());
+
+    /* The thread takes no signals; they are all for the main one */
+    Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev);
+    if ((errno = pthread_create(&waker, NULL, pool_waker, NULL)) != 0)
+        unix_error("pthread_create error");
+    pthread_detach(waker);
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+    return 0;
+}
+
+/* 
+ * pool_find - Index of the pool called name, or -1. If create is set a
+ *     missing pool is added with no slots. Needs the file lock to
+ *     create, since two shells may add pools at once.
+ */
+int 
+pool_find(const char *name, int create) 
+{
+    int i, found = -1;
+
+    if (create)
+        flock(poolsfd, LOCK_EX);
+    for (i = 0; i < MAXPOOLS && found < 0; i++)
+        if (!strcmp(poolfile->pool[i].name, name))
+            found = i;
+    for (i = 0; i < MAXPOOLS && found < 0 && create; i++) {
+        if (poolfile->pool[i].name[0] == '\0') {
+            poolfile->pool[i].limit = 0;
+            strncpy(poolfile->pool[i].name, name, MAXNAME - 1);
+            found = i;
+        }
+    }
+    if (create)
+        flock(poolsfd, LOCK_UN);
+    return found;
+}
+
+/* 
+ * pool_holder_dead - True if the job holding slot is gone and so is the
+ *     shell that started it. A live shell gives its slots back itself
+ *     when it reaps the job.
+ */
+int 
+pool_holder_dead(struct poolslot_t *slot) 
+{
+    int olderrno = errno, dead;
+    pid_t job = __atomic_load_n(&slot->job, __ATOMIC_ACQUIRE);
+    pid_t shell = __atomic_load_n(&slot->shell, __ATOMIC_ACQUIRE);
+    unsigned long long start;
+
+    /* shell is 0 for a moment after the slot is taken */
+    if (job == 0 || shell == 0)
+        return 0;
+    if (slot->shell_start != 0 ? proc_starttime(shell) == slot->shell_start
+        : kill(shell, 0) == 0 || errno != ESRCH)
+        return 0;
+
+    /* The leader's PID may belong to another process by now */
+    if ((start = proc_starttime(job)) != 0 && slot->job_start != 0)
+        dead = start != slot->job_start;
+    else
+        dead = kill(-job, 0) < 0 && errno == ESRCH; /* any process of the job */
+    errno = olderrno;
+    return dead;
+}
+
+/* 
+ * pool_acquire - Take a slot of the job's pool, if it needs one.
+ *     Returns false if all slots are in use. Safe in a signal handler.
+ */
+int 
+pool_acquire(struct job_t *job) 
+{
+    struct pool_t *pool;
+    struct poolslot_t *slot;
+    pid_t holder;
+    int i;
+
+    if (job->pool < 0 || job->poolslot >= 0)
+        return 1;
+    pool = &poolfile->pool[job->pool];
+    for (i = 0; i < pool->limit && i < MAXSLOTS; i++) {
+        slot = &pool->slot[i];
+        holder = __atomic_load_n(&slot->job, __ATOMIC_ACQUIRE);
+        if (holder != 0 && !pool_holder_dead(slot))
+            continue;
+        if (__atomic_compare_exchange_n(&slot->job, &holder, job->pid, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            slot->job_start = proc_starttime(job->pid);
+            slot->shell_start = shell_start;
+            __atomic_store_n(&slot->shell, getpid(), __ATOMIC_RELEASE);
+            job->poolslot = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* pool_release - Give back the slot a job holds. Safe in a signal handler */
+void 
+pool_release(struct job_t *job) 
+{
+    struct poolslot_t *slot;
+
+    if (job->pool < 0 || job->poolslot < 0)
+        return;
+    slot = &poolfile->pool[job->pool].slot[job->poolslot];
+    __atomic_store_n(&slot->shell, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->job, 0, __ATOMIC_RELEASE);
+    job->poolslot = -1;
+    pool_wake();
+}
+
+/* pool_wake - Tell the shells waiting for a slot to look again */
+void 
+pool_wake(void) 
+{
+    __atomic_add_fetch(&poolfile->released, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &poolfile->released, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+/******************************
+ * end host-wide pool routines
+ ******************************/
+
+/***********************************************
+ * PATH cache routines
+ **********************************************/
+
+/* pathc_hash - FNV-1a hash of a string */
+static unsigned long 
+pathc_hash(const char *s) 
+{
+    unsigned long hash = 14695981039346656037ul;
+
+    for (; *s; s++)
+        hash = (hash ^ (unsigned char) *s) * 1099511628211ul;
+    return hash;
+}
+
+/* pathc_sum - Checksum of the n bytes at p, 8 at a time */
+static unsigned long 
+pathc_sum(const void *p, size_t n) 
+{
+    const unsigned long *w = p;
+    unsigned long sum = 14695981039346656037ul;
+    size_t i;
+
+    for (i = 0; i < n / 8; i++)
+        sum = (sum ^ w[i]) * 1099511628211ul;
+    return sum;
+}
+
+/* pathc_file - Name of the cache file of path */
+static void 
+pathc_file(const char *path, char *file) 
+{
+    const char *dir = getenv("TSH_PATHCACHE");
+
+    snprintf(file, MAXLINE, "%s/tsh-path.%d.%016lx", dir ? dir : "/dev/shm",
+             (int) geteuid(), pathc_hash(path));
+}
+
+/* 
+ * pathc_addstr - Append n bytes of s and a NUL to the strings being
+ *     built, keeping room for the padding. Returns the offset.
+ */
+static unsigned int 
+pathc_addstr(char **str, size_t *len, size_t *cap, const char *s, size_t n) 
+{
+    size_t off = *len;
+
+    while (*len + n + 8 > *cap) {
+        *cap = *cap ? 2 * *cap : 4096;
+        *str = Realloc(*str, *cap);
+    }
+    memcpy(*str + off, s, n);
+    (*str)[off + n] = '\0';
+    *len += n + 1;
+    return off;
+}
+
+/* 
+ * resolve_command - The program tok runs: its command word if that has
+ *     a slash, else the executable found in PATH, put in buf. NULL if
+ *     there is none. A PATH=... word before the command is searched
+ *     instead, since that is the PATH the command gets, but without a
+ *     cache file, so one-off PATHs leave none behind.
+ */
+const char * 
+resolve_command(struct cmdline_tokens *tok, char *buf) 
+{
+    const char *path = NULL, *own, *name;
+    struct stat sb;
+    int i;
+
+    for (i = 0; i < tok->argc && isassign(tok->argv[i]); i++)
+        if (!strncmp(tok->argv[i], "PATH=", 5))
+            path = tok->argv[i] + 5;
+    if (i == tok->argc)
+        return NULL;
+    name = tok->argv[i];
+    if (strchr(name, '/') != NULL)
+        return name;
+    if (name[0] == '\0')
+        return NULL;
+    if ((own = getvar("PATH")) == NULL)
+        own = "/bin:/usr/bin";
+    if (path == NULL)
+        path = own;
+    if (!strcmp(path, own) && pathc_refresh(path) == 0
+        && pathc_lookup(name, buf) != NULL)
+        return buf;
+
+    /* 
+     * No cache for this PATH, or a miss: the cache may be up to
+     * PATHCHECK_MS old, so a command just installed is searched for
+     * the slow way
+     */
+    for (;;) {
+        i = strcspn(path, ":");
+        if (i == 0)  /* An empty entry is the current directory */
+            snprintf(buf, MAXLINE, "./%s", name);
+        else
+            snprintf(buf, MAXLINE, "%.*s/%s", i, path, name);
+        if (stat(buf, &sb) == 0 && S_ISREG(sb.st_mode) && access(buf, X_OK) == 0)
+            return buf;
+        if (path[i] == '\0')
+            return NULL;
+        path += i + 1;
+    }
+}
+
+/* 
+ * pathc_cacheable - True if path can have a cache file: the meaning of
+ *     a relative directory changes with the current directory
+ */
+int 
+pathc_cacheable(const char *path) 
+{
+    int ndirs = 0;
+
+    if (strlen(path) >= MAXLINE)
+        return 0;
+    for (;;) {
+        if (*path != '/' || ++ndirs > MAXPATHDIRS)
+            return 0;
+        path += strcspn(path, ":");
+        if (*path++ == '\0')
+            return 1;
+    }
+}
+
+/* 
+ * pathc_attach - Map the cache file of path in place of pathcache, if
+ *     it is ours, whole and for this very PATH. Returns 0 on success.
+ *     Whether it is still fresh is up to the caller.
+ */
+int 
+pathc_attach(const char *path) 
+{
+    char file[MAXLINE];
+    struct pathcache_t *pc;
+    struct pathdir_t *dirs;
+    struct pathent_t *ents;
+    struct stat sb;
+    unsigned long nstr;
+    unsigned int i;
+    const char *str;
+    void *map;
+    int fd;
+
+    if (pathcache != NULL)
+        munmap(pathcache, pathcache->size);
+    pathcache = NULL;
+    pathc_file(path, file);
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat(fd, &sb) < 0 || sb.st_uid != geteuid()
+        || sb.st_size < (off_t) sizeof(struct pathcache_t) || sb.st_size % 8) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    /* Check all that a lookup relies on, so a bad file cannot hurt it */
+    pc = map;
+    dirs = (struct pathdir_t *) (pc + 1);
+    ents = (struct pathent_t *) (dirs + pc->ndirs);
+    str = (char *) map + pc->strings;
+    nstr = sb.st_size - pc->strings;
+    if (memcmp(pc->magic, PATHC_MAGIC, sizeof(pc->magic))
+        || pc->version != PATHC_VERSION || pc->size != (unsigned long) sb.st_size
+        || pc->ndirs > MAXPATHDIRS || pc->nbuckets == 0
+        || (pc->nbuckets & (pc->nbuckets - 1)) || pc->nents >= pc->nbuckets
+        || pc->strings != sizeof(struct pathcache_t)
+           + pc->ndirs * sizeof(struct pathdir_t)
+           + (unsigned long) pc->nbuckets * sizeof(struct pathent_t)
+        || pc->strings >= pc->size || str[nstr - 1] != '\0'
+        || pc->checksum != pathc_sum(pc + 1, pc->size - sizeof(struct pathcache_t))
+        || pc->pathhash != pathc_hash(path) || strcmp(str, path))
+        goto bad;
+    for (i = 0; i < pc->ndirs; i++)
+        if (dirs[i].name + (unsigned long) dirs[i].len >= nstr)
+            goto bad;
+    for (i = 0; i < pc->nbuckets; i++)
+        if (ents[i].name && (ents[i].name >= nstr || ents[i].dir >= pc->ndirs))
+            goto bad;
+    pathcache = pc;
+    return 0;
+
+ bad:
+    munmap(map, sb.st_size);
+    return -1;
+}
+
+/* pathc_fresh - True if no directory of pathcache changed since its scan */
+int 
+pathc_fresh(void) 
+{
+    struct pathdir_t *dirs = (struct pathdir_t *) (pathcache + 1);
+    const char *str = (char *) pathcache + pathcache->strings;
+    struct stat sb;
+    unsigned int i;
+
+    for (i = 0; i < pathcache->ndirs; i++) {
+        if (stat(str + dirs[i].name, &sb) < 0) {
+            if (dirs[i].mtime_sec != -1)
+                return 0;
+        }
+        else if (sb.st_mtim.tv_sec != dirs[i].mtime_sec
+                 || sb.st_mtim.tv_nsec != dirs[i].mtime_nsec)
+            return 0;
+    }
+    return 1;
+}
+
+/* 
+ * pathc_build - Scan the directories of path, write a new cache file
+ *     and rename it over the old one, then map it. The first directory
+ *     with a command wins, as in a search. Returns 0 on success.
+ */
+int 
+pathc_build(const char *path) 
+{
+    struct pathcache_t hdr;
+    struct pathdir_t dirs[MAXPATHDIRS];
+    struct pathent_t *names = NULL, *ents;
+    char file[MAXLINE], tmp[MAXLINE + 8], *str = NULL, *buf;
+    size_t nstr = 0, capstr = 0, nnames = 0, capnames = 0, j;
+    unsigned int ndirs = 0, nbuckets, mask, i;
+    const char *p;
+    struct dirent *de;
+    struct stat sb;
+    DIR *dir;
+    int fd, ok;
+
+    /* The strings are PATH, then the directories, then the names */
+    pathc_addstr(&str, &nstr, &capstr, path, strlen(path));
+    for (p = path; ndirs < MAXPATHDIRS; p++) {
+        dirs[ndirs].len = strcspn(p, ":");
+        dirs[ndirs].name = pathc_addstr(&str, &nstr, &capstr, p, dirs[ndirs].len);
+        p += dirs[ndirs++].len;
+        if (*p == '\0')
+            break;
+    }
+    for (i = 0; i < ndirs; i++) {
+        /* Take the mtime first, so a change during the scan shows */
+        dirs[i].mtime_sec = dirs[i].mtime_nsec = -1;
+        if (stat(str + dirs[i].name, &sb) < 0)
+            continue;
+        dirs[i].mtime_sec = sb.st_mtim.tv_sec;
+        dirs[i].mtime_nsec = sb.st_mtim.tv_nsec;
+        if ((dir = opendir(str + dirs[i].name)) == NULL)
+            continue;
+        while ((de = readdir(dir)) != NULL) {
+            if (de->d_name[0] == '.' || de->d_type == DT_DIR)
+                continue;
+            if (fstatat(dirfd(dir), de->d_name, &sb, 0) < 0 || !S_ISREG(sb.st_mode)
+                || faccessat(dirfd(dir), de->d_name, X_OK, 0) < 0)
+                continue;
+            if (nnames == capnames) {
+                capnames = capnames ? 2 * capnames : 256;
+                names = Realloc(names, capnames * sizeof(struct pathent_t));
+            }
+            names[nnames].hash = pathc_hash(de->d_name);
+            names[nnames].name = pathc_addstr(&str, &nstr, &capstr, de->d_name,
+                                              strlen(de->d_name));
+            names[nnames++].dir = i;
+        }
+        closedir(dir);
+    }
+
+    /* Lay the file out in one buffer, to checksum and write it */
+    for (nbuckets = 16; nbuckets < 2 * nnames; nbuckets *= 2)
+        ;
+    mask = nbuckets - 1;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PATHC_MAGIC, sizeof(hdr.magic));
+    hdr.version = PATHC_VERSION;
+    hdr.ndirs = ndirs;
+    hdr.nbuckets = nbuckets;
+    hdr.pathhash = pathc_hash(path);
+    hdr.strings = sizeof(hdr) + ndirs * sizeof(struct pathdir_t)
+        + (unsigned long) nbuckets * sizeof(struct pathent_t);
+    while ((hdr.strings + nstr) % 8)
+        str[nstr++] = '\0';
+    hdr.size = hdr.strings + nstr;
+    buf = Calloc(1, hdr.size);
+    memcpy(buf + sizeof(hdr), dirs, ndirs * sizeof(struct pathdir_t));
+    ents = (struct pathent_t *) (buf + sizeof(hdr) + ndirs * sizeof(struct pathdir_t));
+    for (j = 0; j < nnames; j++) {
+        for (i = names[j].hash & mask; ents[i].name; i = (i + 1) & mask)
+            if (ents[i].hash == names[j].hash
+                && !strcmp(str + ents[i].name, str + names[j].name))
+                break;
+        if (!ents[i].name) {
+            ents[i] = names[j];
+            hdr.nents++;
+        }
+    }
+    memcpy(buf + hdr.strings, str, nstr);
+    hdr.checksum = pathc_sum(buf + sizeof(hdr), hdr.size - sizeof(hdr));
+    memcpy(buf, &hdr, sizeof(hdr));
+    free(names);
+    free(str);
+
+    /* Shells mapping the old file keep it until they look again */
+    pathc_file(path, file);
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file);
+    ok = (fd = mkostemp(tmp, O_CLOEXEC)) >= 0;
+    if (ok) {
+        ok = write(fd, buf, hdr.size) == (ssize_t) hdr.size;
+        ok = close(fd) == 0 && ok && rename(tmp, file) == 0;
+        if (!ok)
+            unlink(tmp);
+    }
+    free(buf);
+    if (verbose)
+        printf("pathc_build: %s: %s, %u commands\n", file,
+               ok ? "written" : strerror(errno), hdr.nents);
+    fflush(stdout);
+    return ok ? pathc_attach(path) : -1;
+}
+
+/* 
+ * pathc_refresh - Make pathcache the table of path, mapping or building
+ *     it if need be. Its directories are stat'ed at most once every
+ *     PATHCHECK_MS. Returns 0, or -1 if path is to be searched as is.
+ */
+int 
+pathc_refresh(const char *path) 
+{
+    static long failed = -PATHCHECK_MS; /* when a build last failed */
+    long now = now_ms();
+    int mapped;
+
+    mapped = pathcache != NULL && pathcache->pathhash == pathc_hash(path)
+        && !strcmp((char *) pathcache + pathcache->strings, path);
+    if (mapped && now - pathcache_checked < PATHCHECK_MS)
+        return 0;
+    if (!pathc_cacheable(path))
+        return -1;
+    pathcache_checked = now;
+    if (mapped && pathc_fresh())
+        return 0;
+
+    /* Another shell may have built it already */
+    if (pathc_attach(path) == 0 && pathc_fresh())
+        return 0;
+    if (now - failed < PATHCHECK_MS)
+        return -1;
+    if (pathc_build(path) == 0)
+        return 0;
+    failed = now;
+    return -1;
+}
+
+/* pathc_lookup - Find name in pathcache. Returns its path in buf, or NULL */
+const char * 
+pathc_lookup(const char *name, char *buf) 
+{
+    struct pathdir_t *dirs = (struct pathdir_t *) (pathcache + 1);
+    struct pathent_t *ents = (struct pathent_t *) (dirs + pathcache->ndirs);
+    const char *str = (char *) pathcache + pathcache->strings;
+    unsigned long hash = pathc_hash(name);
+    unsigned int mask = pathcache->nbuckets - 1, i;
+
+    for (i = hash & mask; ents[i].name; i = (i + 1) & mask)
+        if (ents[i].hash == (unsigned int) hash && !strcmp(str + ents[i].name, name)) {
+            snprintf(buf, MAXLINE, "%s/%s", str + dirs[ents[i].dir].name, name);
+            return buf;
+        }
+    return NULL;
+}
+/******************************
+ * end PATH cache routines
+ ******************************/
+
+/***********************************************
+ * Session recording routines
+ **********************************************/
+
+/* record_open - Start recording the session to path */
+void 
+record_open(const char *path) 
+{
+    static char header[] = "#\n# Session recorded by tsh -r\n#\n";
+
+    if ((recordfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                         0644)) < 0)
+        unix_error("record: open error");
+    if (write(recordfd, header, strlen(header)) < 0)
+        unix_error("record: write error");
+    record_ms = now_ms();
+}
+
+/* 
+ * record_line - Record an input line. Returns false, and records
+ *     nothing, for lines runtrace would not send to the shell as they
+ *     are: blank lines, comments and runtrace directives.
+ */
+int 
+record_line(const char *cmdline) 
+{
+    static const char *directives[] = {
+        "WAIT", "NEXT", "SIGNAL", "SIGINT", "SIGTSTP", "DELAY", NULL
+    };
+    const char *p = cmdline;
+    size_t len;
+    int i;
+
+    if (recordfd < 0)
+        return 0;
+    while (isspace((unsigned char) *p))
+        p++;
+    if (*p == '\0' || cmdline[0] == '#')
+        return 0;
+    for (len = 0; p[len] && !isspace((unsigned char) p[len]); len++)
+        ;
+    for (i = 0; directives[i]; i++)
+        if (strlen(directives[i]) == len && !strncmp(p, directives[i], len))
+            return 0;
+    record_event(cmdline, 1);
+    return 1;
+}
+
+/* 
+ * record_event - Append event to the recorded trace, after a DELAY with
+ *     the time since the last event if delay is set. One write per
+ *     event, so it is safe in a signal handler.
+ */
+void 
+record_event(const char *event, int delay) 
+{
+    char buf[MAXLINE + 32], digits[24];
+    size_t n = 0, len;
+    long now, ms;
+    int olderrno = errno, i = 0;
+
+    if (recordfd < 0)
+        return;
+    now = now_ms();
+    ms = now - record_ms;
+    record_ms = now;
+    if (delay && ms > 0) {
+        memcpy(buf, "DELAY ", 6);
+        n = 6;
+        do {
+            digits[i++] = '0' + ms % 10;
+        } while ((ms /= 10) > 0);
+        while (i > 0)
+            buf[n++] = digits[--i];
+        buf[n++] = '\n';
+    }
+    if ((len = strlen(event)) > MAXLINE)
+        len = MAXLINE;
+    memcpy(buf + n, event, len);
+    n += len;
+    buf[n++] = '\n';
+    if (write(recordfd, buf, n) < 0)
+        ; /* Losing the trace must not break the session */
+    errno = olderrno;
+}
+/******************************
+ * end session recording routines
+ ******************************/
+
+/***********************************************
+ * JSON output routines
+ **********************************************/
+
+/* 
+ * A JSON line is built in a small buffer on the caller's stack and
+ * written out whenever the buffer fills, so a line of any length
+ * needs no allocation, and the writer is safe in signal handlers.
+ * Signals are blocked from jw_begin to jw_end, so a handler's line
+ * never lands inside one that is only partly written.
+ */
+
+/* jw_flush - Write out what is buffered */
+static void 
+jw_flush(struct jw_t *w) 
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < w->n) {
+        if ((n = write(w->fd, w->buf + done, w->n - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;  /* nobody is listening; drop it */
+        }
+        done += n;
+    }
+    w->n = 0;
+}
+
+/* jw_put - Append n raw bytes */
+static void 
+jw_put(struct jw_t *w, const char *s, size_t n) 
+{
+    size_t k;
+
+    while (n > 0) {
+        if (w->n == JSONBUF)
+            jw_flush(w);
+        k = JSONBUF - w->n < n ? JSONBUF - w->n : n;
+        memcpy(w->buf + w->n, s, k);
+        w->n += k;
+        s += k;
+        n -= k;
+    }
+}
+
+/* 
+ * utf8_len - Length of the well-formed UTF-8 sequence at s, at most n
+ *     bytes long, or 0 if it is not one
+ */
+static int 
+utf8_len(const unsigned char *s, size_t n) 
+{
+    int len, i;
+    unsigned char lo = 0x80, hi = 0xbf;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf)
+        len = 2;
+    else if (s[0] >= 0xe0 && s[0] <= 0xef)
+        len = 3;
+    else if (s[0] >= 0xf0 && s[0] <= 0xf4)
+        len = 4;
+    else
+        return 0;
+    if ((size_t) len > n)
+        return 0;
+
+    /* Reject overlong forms, surrogates and code points past U+10FFFF */
+    if (s[0] == 0xe0)
+        lo = 0xa0;
+    else if (s[0] == 0xed)
+        hi = 0x9f;
+    else if (s[0] == 0xf0)
+        lo = 0x90;
+    else if (s[0] == 0xf4)
+        hi = 0x8f;
+    if (s[1] < lo || s[1] > hi)
+        return 0;
+    for (i = 2; i < len; i++)
+        if (s[i] < 0x80 || s[i] > 0xbf)
+            return 0;
+    return len;
+}
+
+/* 
+ * jw_escape - Append the bytes of s as the inside of a JSON string.
+ *     Valid UTF-8 is copied; control characters and bytes that are not
+ *     valid UTF-8 become \u00XX escapes. With w->trim set, a newline is
+ *     held back until more text follows, which drops a trailing one.
+ */
+static void 
+jw_escape(struct jw_t *w, const char *s, size_t n) 
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *) s;
+    char esc[6] = {'\\', 'u', '0', '0'};
+    size_t i, run;
+    int len;
+
+    for (i = 0; i < n; i += len) {
+        if (w->held) {
+            jw_put(w, "\\n", 2);
+            w->held = 0;
+        }
+        len = 1;
+        if (p[i] == '\n' && w->trim)
+            w->held = 1;
+        else if (p[i] == '"' || p[i] == '\\') {
+            jw_put(w, "\\", 1);
+            jw_put(w, s + i, 1);
+        }
+        else if (p[i] == '\n')
+            jw_put(w, "\\n", 2);
+        else if (p[i] == '\t')
+            jw_put(w, "\\t", 2);
+        else if (p[i] >= 0x20 && p[i] < 0x7f) {
+            /* Copy a run of plain characters at once */
+            for (run = 1; i + run < n && p[i+run] >= 0x20 && p[i+run] < 0x7f
+                     && p[i+run] != '"' && p[i+run] != '\\'; run++)
+                ;
+            jw_put(w, s + i, run);
+            len = run;
+        }
+        else if (p[i] >= 0x80 && (len = utf8_len(p + i, n - i)) > 0)
+            jw_put(w, s + i, len);
+        else {
+            len = 1;
+            esc[4] = hex[p[i] >> 4];
+            esc[5] = hex[p[i] & 0xf];
+            jw_put(w, esc, 6);
+        }
+    }
+}
+
+/* jw_key - Start a member named key */
+static void 
+jw_key(struct jw_t *w, const char *key) 
+{
+    if (w->members++)
+        jw_put(w, ",", 1);
+    jw_put(w, "\"", 1);
+    jw_put(w, key, strlen(key));
+    jw_put(w, "\":", 2);
+}
+
+/* jw_begin - Start a JSON line of the given type on fd */
+void 
+jw_begin(struct jw_t *w, int fd, const char *type) 
+{
+    sigset_t mask;
+
+    Sigfillset(&mask);
+    Sigprocmask(SIG_BLOCK, &mask, &w->prev);
+    w->fd = fd;
+    w->n = 0;
+    w->members = 0;
+    w->trim = w->held = 0;
+    jw_put(w, "{", 1);
+    jw_str(w, "type", type);
+}
+
+/* jw_str - Add a string member */
+void 
+jw_str(struct jw_t *w, const char *key, const char *value) 
+{
+    jw_key(w, key);
+    jw_put(w, "\"", 1);
+    jw_escape(w, value, strlen(value));
+    jw_put(w, "\"", 1);
+}
+
+/* jw_int - Add an integer member */
+void 
+jw_int(struct jw_t *w, const char *key, long value) 
+{
+    char digits[24];
+    int i = sizeof(digits);
+    unsigned long v = value < 0 ? -(unsigned long) value : (unsigned long) value;
+
+    do {
+        digits[--i] = '0' + v % 10;
+    } while ((v /= 10) > 0);
+    if (value < 0)
+        digits[--i] = '-';
+    jw_key(w, key);
+    jw_put(w, digits + i, sizeof(digits) - i);
+}
+
+/* jw_end - Finish the line and write it out */
+void 
+jw_end(struct jw_t *w) 
+{
+    jw_put(w, "}\n", 2);
+    jw_flush(w);
+    Sigprocmask(SIG_SETMASK, &w->prev, NULL);
+}
+
+/* json_fd - Where JSON goes, if human output would go to fd */
+int 
+json_fd(int fd) 
+{
+    return jsonfd >= 0 ? jsonfd : fd;
+}
+
+/* human - True if the human readable output is wanted */
+int 
+human(void) 
+{
+    return !json || jsonfd >= 0;
+}
+
+/* state_name - Name of a job state in JSON output */
+const char *
+state_name(int state) 
+{
+    switch (state) {
+    case BG:
+        return "running";
+    case FG:
+        return "foreground";
+    case ST:
+        return "stopped";
+    case QU:
+        return "queued";
+    default:
+        return "undefined";
+    }
+}
+
+/* 
+ * notice - Announce a job event: "start", "continue", "stop" or "exit".
+ *     key and value add one more member if key is not NULL. Safe in a
+ *     signal handler.
+ */
+void 
+notice(const char *type, struct job_t *job, const char *key, long value) 
+{
+    struct jw_t w;
+
+    if (!json)
+        return;
+    jw_begin(&w, json_fd(STDOUT_FILENO), type);
+    jw_int(&w, "jid", job->jid);
+    jw_int(&w, "pid", job->pid);
+    jw_str(&w, "state", state_name(job->state));
+    if (key != NULL)
+        jw_int(&w, key, value);
+    jw_str(&w, "cmdline", job->cmdline);
+    jw_end(&w);
+}
+
+/* 
+ * report_error - Print an error message made of the strings given,
+ *     up to a NULL, or put it in an "error" JSON line. Safe in a
+ *     signal handler.
+ */
+void 
+report_error(char *s, ...) 
+{
+    struct jw_t w;
+    va_list ap;
+    char *part;
+
+    if (human()) {
+        va_start(ap, s);
+        for (part = s; part != NULL; part = va_arg(ap, char *))
+            sio_puts(part);
+        va_end(ap);
+    }
+    if (json) {
+        jw_begin(&w, json_fd(STDOUT_FILENO), "error");
+        jw_key(&w, "message");
+        jw_put(&w, "\"", 1);
+        w.trim = 1;
+        va_start(ap, s);
+        for (part = s; part != NULL; part = va_arg(ap, char *))
+            jw_escape(&w, part, strlen(part));
+        va_end(ap);
+        jw_put(&w, "\"", 1);
+        jw_end(&w);
+    }
+}
+/******************************
+ * end JSON output routines
+ ******************************/
+
+/***********************************************
+ * Timer wheel routines
+ **********************************************/
+
+/* 
+ * Timers of every and at live in a hierarchical timer wheel: level l
+ * holds the timers due in fewer than 64^(l+1) ticks, hashed by bits
+ * 6l..6l+5 of their expiry tick. Each time the low bits of the current
+ * tick wrap, the matching slot of the next level is cascaded down, so
+ * adding, removing and expiring a timer are O(1). A single timerfd is
+ * armed for the next tick that can have work, and the main loop and
+ * the foreground waits run the due timers when it fires.
+ */
+
+/* wheel_now - The current tick */
+static unsigned long 
+wheel_now(void) 
+{
+    return (now_ms() - wheel_base) / TICK_MS;
+}
+
+/* wheel_insert - Hang t in the slot for its expiry tick */
+static void 
+wheel_insert(struct wtimer_t *t) 
+{
+    unsigned long delta;
+    int level;
+
+    if (t->expires <= wheel_tick)
+        t->expires = wheel_tick + 1;
+    delta = t->expires - wheel_tick;
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+        if (delta < 1ul << (WHEEL_BITS * (level + 1)))
+            break;
+    if (delta >= 1ul << (WHEEL_BITS * WHEEL_LEVELS))
+        t->expires = wheel_tick + (1ul << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    t->pprev = &wheel[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    t->next = *t->pprev;
+    if (t->next)
+        t->next->pprev = &t->next;
+    *t->pprev = t;
+}
+
+/* wheel_remove - Take t off its slot */
+static void 
+wheel_remove(struct wtimer_t *t) 
+{
+    if (t->pprev == NULL)
+        return;
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/* 
+ * wheel_advance - Move the wheel forward to tick, putting the timers
+ *     that expire on the due list
+ */
+static void 
+wheel_advance(unsigned long tick, struct wtimer_t **due) 
+{
+    struct wtimer_t *t, *list;
+    int level, idx;
+
+    while (wheel_tick < tick) {
+        wheel_tick++;
+        idx = wheel_tick & WHEEL_MASK;
+
+        /* The low bits wrapped: cascade the next level's slot down */
+        for (level = 1; idx == 0 && level < WHEEL_LEVELS; level++) {
+            idx = (wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            list = wheel[level][idx];
+            wheel[level][idx] = NULL;
+            while ((t = list) != NULL) {
+                list = t->next;
+                t->pprev = NULL;
+                wheel_insert(t);
+            }
+        }
+
+        while ((t = wheel[0][wheel_tick & WHEEL_MASK]) != NULL) {
+            wheel_remove(t);
+            t->next = *due;
+            *due = t;
+        }
+    }
+}
+
+/* wheel_arm - Set the timerfd for the next tick that can have work */
+static void 
+wheel_arm(void) 
+{
+    struct itimerspec its;
+    unsigned long next = 0, boundary;
+    long ms;
+    int k, level, idx;
+
+    memset(&its, 0, sizeof(its));
+
+    /* The first non-empty slot of level 0 ... */
+    for (k = 1; k <= WHEEL_SIZE && next == 0; k++)
+        if (wheel[0][(wheel_tick + k) & WHEEL_MASK] != NULL)
+            next = wheel_tick + k;
+
+    /* ... or the next cascade, if the higher levels hold anything */
+    boundary = (wheel_tick | WHEEL_MASK) + 1;
+    for (level = 1; level < WHEEL_LEVELS; level++)
+        for (idx = 0; idx < WHEEL_SIZE; idx++)
+            if (wheel[level][idx] != NULL && (next == 0 || boundary < next))
+                next = boundary;
+
+    if (next != 0) {
+        ms = wheel_base + next * TICK_MS;
+        its.it_value.tv_sec = ms / 1000;
+        its.it_value.tv_nsec = (ms % 1000) * 1000000;
+    }
+    timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* timer_running - True if the last run of t has not ended yet */
+static int 
+timer_running(struct wtimer_t *t) 
+{
+    return t->pgid != 0 && getjobpid(job_list, t->pgid) != NULL;
+}
+
+/* timer_launch - Run the command of t as a background job */
+static void 
+timer_launch(struct wtimer_t *t) 
+{
+    char line[MAXLINE + 2];
+
+    snprintf(line, sizeof(line), "%s &", t->cmdline);
+    lastbg = 0;
+    eval(line);
+    t->pgid = lastbg;
+    t->runs++;
+}
+
+/* 
+ * timer_fire - t is due: run it unless its last run is still going, in
+ *     which case its overlap policy decides
+ */
+static void 
+timer_fire(struct wtimer_t *t) 
+{
+    unsigned long now = wheel_tick;
+
+    if (timer_running(t)) {
+        if (t->policy == OVL_SKIP)
+            t->skipped++;
+        else if (t->policy == OVL_QUEUE)
+            t->pending = 1;  /* runs once the last one ends */
+        else {
+            kill(-t->pgid, SIGTERM);
+            timer_launch(t);
+        }
+    }
+    else
+        timer_launch(t);
+
+    if (t->interval == 0) {  /* at: done */
+        if (!t->pending)
+            t->used = 0;
+        return;
+    }
+
+    /* Keep to the original schedule; periods already missed are skipped */
+    t->expires += t->interval;
+    while (t->expires <= now) {
+        t->expires += t->interval;
+        t->skipped++;
+    }
+    wheel_insert(t);
+}
+
+/* 
+ * timers_run - Run the timers that are due and the queued runs whose
+ *     last run has ended, then re-arm the timerfd
+ */
+void 
+timers_run(void) 
+{
+    struct wtimer_t *due = NULL, *t;
+    sigset_t mask, prev;
+    uint64_t expirations;
+    int i;
+
+    if (timerfd < 0)
+        return;
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGTSTP);
+    Sigaddset(&mask, SIGALRM);
+    Sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    if (read(timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        unix_error("timerfd read error");
+    wheel_advance(wheel_now(), &due);
+    while ((t = due) != NULL) {
+        due = t->next;
+        t->next = NULL;
+        if (t == &reclaim_timer)
+            reclaim_run();
+        else
+            timer_fire(t);
+    }
+
+    for (i = 0; i < MAXTIMERS; i++) {
+        t = &timer_list[i];
+        if (t->used && t->pending && !timer_running(t)) {
+            t->pending = 0;
+            timer_launch(t);
+            if (t->interval == 0)
+                t->used = 0;
+        }
+    }
+
+    wheel_arm();
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* timer_init - Create the timerfd the first time a timer is needed */
+static void 
+timer_init(void) 
+{
+    if (timerfd >= 0)
+        return;
+    if ((timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        unix_error("timerfd_create error");
+    wheel_base = now_ms();
+    wheel_tick = 0;
+}
+
+/* 
+ * timer_add - Add a timer that first fires after delay ms, then every
+ *     interval ms if interval is not 0. Returns it, or NULL if the
+ *     table is full.
+ */
+struct wtimer_t *
+timer_add(long delay, long interval, int policy, const char *cmdline) 
+{
+    struct wtimer_t *t = NULL;
+    int i;
+
+    timer_init();
+    for (i = 0; i < MAXTIMERS && t == NULL; i++)
+        if (!timer_list[i].used)
+            t = &timer_list[i];
+    if (t == NULL)
+        return NULL;
+
+    memset(t, 0, sizeof(*t));
+    t->used = 1;
+    t->id = i;
+    t->policy = policy;
+    t->interval = (interval + TICK_MS - 1) / TICK_MS;
+    snprintf(t->cmdline, MAXLINE, "%s", cmdline);
+
+    /* Catch up first, so the delay counts from now */
+    timers_run();
+    t->expires = wheel_now() + (delay + TICK_MS - 1) / TICK_MS;
+    wheel_insert(t);
+    wheel_arm();
+    return t;
+}
+
+/* timer_cancel - Cancel timer t; a run in progress goes on */
+void 
+timer_cancel(struct wtimer_t *t) 
+{
+    wheel_remove(t);
+    t->used = 0;
+    wheel_arm();
+}
+
+/* timer_next_ms - Milliseconds until timer t fires next */
+long 
+timer_next_ms(struct wtimer_t *t) 
+{
+    long ms = wheel_base + (long) t->expires * TICK_MS - now_ms();
+
+    return ms > 0 ? ms : 0;
+}
+
+/* 
+ * wait_signal - Like sigsuspend(mask), but when a timer is due, run it
+ *     and return as if a signal had arrived
+ */
+void 
+wait_signal(const sigset_t *mask) 
+{
+    struct pollfd pfd[MAXJOBS + 1];
+    int n = 0;
+
+    if (timerfd >= 0) {
+        pfd[n].fd = timerfd;
+        pfd[n++].events = POLLIN;
+    }
+    n += freezer_fds(pfd + n);
+    if (n == 0)
+        Sigsuspend(mask);
+    else {
+        if ((ppoll(pfd, n, NULL, mask) > 0 || !timer_list_idle()) && timerfd >= 0)
+            timers_run();
+        freezer_run();
+    }
+    if (reclaim_due)
+        reclaim_run();
+}
+
+/* timer_list_idle - True if no timer has a queued run */
+int 
+timer_list_idle(void) 
+{
+    int i;
+
+    for (i = 0; i < MAXTIMERS; i++)
+        if (timer_list[i].used && timer_list[i].pending)
+            return 0;
+    return 1;
+}
+
+static char inbuf[MAXLINE];  /* input read but not yet returned */
+static size_t inlen;
+
+/* 
+ * readline_wait - Read a line from inputfd into cmdline, like fgets,
+ *     and run the timers that fall due while waiting for it. Returns
+ *     NULL at end of file.
+ */
+char *
+readline_wait(char *cmdline) 
+{
+    struct pollfd pfd[2];
+    char *nl;
+    size_t len;
+    ssize_t n;
+
+    while (1) {
+        /* A whole line, or a full buffer, is ready */
+        if ((nl = memchr(inbuf, '\n', inlen)) != NULL || inlen == MAXLINE - 1) {
+            len = nl ? (size_t) (nl - inbuf) + 1 : inlen;
+            memcpy(cmdline, inbuf, len);
+            cmdline[len] = '\0';
+            memmove(inbuf, inbuf + len, inlen - len);
+            inlen -= len;
+            return cmdline;
+        }
+
+        if (reclaim_due)  /* a job stopped; its grace period starts */
+            reclaim_run();
+        pfd[0].fd = inputfd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = timerfd;  /* ignored while it is -1 */
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno != EINTR)
+                unix_error("poll error");
+            timers_run();  /* a job ended; a queued run may start */
+            continue;
+        }
+        if (pfd[1].revents & POLLIN)
+            timers_run();
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if ((n = read(inputfd, inbuf + inlen, MAXLINE - 1 - inlen)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                unix_error("read error");
+            }
+            if (n == 0)  /* End of file; like fgets, drop a partial line */
+                return NULL;
+            inlen += n;
+        }
+    }
+}
+/******************************
+ * end timer wheel routines
+ ******************************/
+
+/***********************************************
+ * Memory reclaim routines
+ **********************************************/
+
+/* rss_anon - Anonymous resident memory of process pid in bytes, or -1 */
+static long 
+rss_anon(pid_t pid) 
+{
+    char path[64], line[MAXLINE];
+    long kb = -1;
+    FILE *fp;
+
+    sprintf(path, "/proc/%d/status", (int) pid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    while (fgets(line, MAXLINE, fp) != NULL)
+        if (sscanf(line, "RssAnon: %ld", &kb) == 1)
+            break;
+    fclose(fp);
+    return kb < 0 ? -1 : kb * 1024;
+}
+
+/* 
+ * reclaim_proc - Advise away the private anonymous mappings of process
+ *     pid, and add how much its RSS shrank to r
+ */
+static void 
+reclaim_proc(pid_t pid, struct reclaim_t *r) 
+{
+    struct iovec iov[64];
+    char path[64], line[MAXLINE], perms[8], name[MAXLINE];
+    unsigned long start, end, inode;
+    long before, after;
+    int pidfd, n = 0, more = 1;
+    FILE *maps;
+
+    sprintf(path, "/proc/%d/maps", (int) pid);
+    if ((pidfd = syscall(SYS_pidfd_open, pid, 0)) < 0) {
+        r->err = errno;
+        return;
+    }
+    if ((maps = fopen(path, "r")) == NULL) {
+        r->err = errno;
+        close(pidfd);
+        return;
+    }
+    before = rss_anon(pid);
+    while (more) {
+        more = fgets(line, MAXLINE, maps) != NULL;
+        name[0] = '\0';
+        if (more && sscanf(line, "%lx-%lx %7s %*s %*s %lu %s",
+                           &start, &end, perms, &inode, name) >= 4
+            && inode == 0 && perms[1] == 'w' && perms[3] == 'p'
+            && (name[0] == '\0' || !strcmp(name, "[heap]")
+                || !strcmp(name, "[stack]") || !strncmp(name, "[anon:", 6))) {
+            iov[n].iov_base = (void *) start;
+            iov[n].iov_len = end - start;
+            n++;
+        }
+        if (n == 64 || (!more && n > 0)) {
+            if (syscall(SYS_process_madvise, pidfd, iov, n, reclaim_advice, 0) < 0)
+                r->err = errno;
+            n = 0;
+        }
+    }
+    fclose(maps);
+    close(pidfd);
+    after = rss_anon(pid);
+    if (before > after && after >= 0)
+        __atomic_add_fetch(&r->bytes, before - after, __ATOMIC_RELAXED);
+}
+
+/* 
+ * reclaim_job - Reclaim entry i of the job list in a helper process,
+ *     which the SIGCHLD handler reaps like any process not in a job
+ */
+static void 
+reclaim_job(struct job_t *job, int i) 
+{
+    struct reclaim_t *r = &reclaim_stats[i];
     pid_t pid;
-    pid = fgpid(job_list);
+    int j;
+
+    job->reclaim_ms = job->stop_ms;
+    if (r->pgid != job->pid) {
+        r->pgid = job->pid;
+        r->bytes = 0;
+    }
+    r->err = 0;
+    if ((pid = fork()) != 0) {
+        if (pid < 0)
+            r->err = errno;
+        return;
+    }
+
+    /* Helper: signals stay blocked, and no keyboard signal reaches it */
+    setpgid(0, 0);
+    for (j = 0; j < job->nprocs; j++)
+        if (job->pids[j] != 0)
+            reclaim_proc(job->pids[j], r);
+    _exit(0);
+}
+
+/* 
+ * reclaim_run - Reclaim the jobs stopped for the grace period, and set
+ *     reclaim_timer for the next one to get there. A job resumed in the
+ *     meantime is skipped, and a job stopped again starts over.
+ */
+void 
+reclaim_run(void) 
+{
+    sigset_t mask_all, prev;
+    struct job_t *job;
+    long now, due, next = -1;
+    int i;
+
+    reclaim_due = 0;
+    if (reclaim_grace < 0)
+        return;
     Sigfillset(&mask_all);
-    Sigprocmask(SIG_BLOCK, &mask_all, &prev); /* Block all signals */
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev);
+    timer_init();
+    wheel_remove(&reclaim_timer);
+    now = now_ms();
+    for (i = 0; i < MAXJOBS; i++) {
+        job = &job_list[i];
+        if (job->pid == 0 || job->state != ST || job->reclaim_ms == job->stop_ms)
+            continue;
+        due = job->stop_ms + reclaim_grace;
+        if (due <= now)
+            reclaim_job(job, i);
+        else if (next < 0 || due < next)
+            next = due;
+    }
+    if (next >= 0) {
+        reclaim_timer.expires = wheel_now() + (next - now + TICK_MS - 1) / TICK_MS;
+        wheel_insert(&reclaim_timer);
+    }
+    wheel_arm();
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+/******************************
+ * end memory reclaim routines
+ ******************************/
+
+/***********************************************
+ * Freezer routines
+ **********************************************/
+
+/* 
+ * freezer_open - Make the cgroup that holds the jobs' cgroups, next to
+ *     the shell's own cgroup in the cgroup v2 hierarchy
+ */
+int 
+freezer_open(void) 
+{
+    char line[MAXLINE], root[MAXLINE], mnt[MAXLINE], fstype[64];
+    char cgpath[MAXLINE] = "", *sep;
+    FILE *fp;
+
+    if (freezerfd >= 0)
+        return 0;
+
+    /* Where cgroup2 is mounted ... */
+    mnt[0] = '\0';
+    if ((fp = fopen("/proc/self/mountinfo", "r")) != NULL) {
+        while (mnt[0] == '\0' && fgets(line, MAXLINE, fp) != NULL)
+            if ((sep = strstr(line, " - ")) != NULL
+                && sscanf(sep, " - %63s", fstype) == 1 && !strcmp(fstype, "cgroup2")
+                && sscanf(line, "%*s %*s %*s %s %s", root, mnt) != 2)
+                mnt[0] = '\0';
+        fclose(fp);
+    }
+    /* ... and the shell's cgroup in it */
+    if ((fp = fopen("/proc/self/cgroup", "r")) != NULL) {
+        while (fgets(line, MAXLINE, fp) != NULL)
+            if (!strncmp(line, "0::", 3)) {
+                line[strcspn(line, "\n")] = '\0';
+                strcpy(cgpath, line + 3);
+            }
+        fclose(fp);
+    }
+    if (mnt[0] == '\0' || cgpath[0] != '/') {
+        report_error("freezer: no cgroup v2 hierarchy\n", NULL);
+        return -1;
+    }
+    if (strcmp(root, "/") && !strncmp(cgpath, root, strlen(root)))
+        memmove(cgpath, cgpath + strlen(root), strlen(cgpath + strlen(root)) + 1);
+
+    snprintf(freezer_dir, sizeof(freezer_dir), "%s%s/tsh.%d", mnt,
+             strcmp(cgpath, "/") ? cgpath : "", (int) getpid());
+    if ((mkdir(freezer_dir, 0755) < 0 && errno != EEXIST)
+        || (freezerfd = open(freezer_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        report_error("freezer: ", freezer_dir, ": ", strerror(errno), "\n", NULL);
+        return -1;
+    }
+    atexit(freezer_close);
+    return 0;
+}
+
+/* freezer_close - Remove tsh.PID, if no job is left in it */
+void 
+freezer_close(void) 
+{
+    char name[24];
+    int i;
+
+    if (freezerfd < 0)  /* A script run by a child tsh */
+        return;
+    for (i = 1; i <= freezer_seq; i++) {
+        sprintf(name, "%d", i);
+        unlinkat(freezerfd, name, AT_REMOVEDIR);
+    }
+    rmdir(freezer_dir);
+}
+
+/* freezer_newgroup - Make a cgroup for a new job, returning it or 0 */
+int 
+freezer_newgroup(void) 
+{
+    char name[24];
+
+    if (freezerfd < 0)
+        return 0;
+    sprintf(name, "%d", ++freezer_seq);
+    if (mkdirat(freezerfd, name, 0755) < 0) {
+        report_error("freezer: ", strerror(errno), "\n", NULL);
+        return 0;
+    }
+    return freezer_seq;
+}
+
+/* 
+ * freezer_join - Move process pid, or the caller if pid is 0, into
+ *     cgroup cgid. The parent and the child both do it, as with the
+ *     process group, so the job is whole before either goes on.
+ *     Returns 0, or -1 if it failed.
+ */
+int 
+freezer_join(int cgid, pid_t pid) 
+{
+    char path[48], buf[24];
+    int fd, n;
+
+    sprintf(path, "%d/cgroup.procs", cgid);
+    sio_ltoa(pid, buf, 10);
+    if ((fd = openat(freezerfd, path, O_WRONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = write(fd, buf, strlen(buf));
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+/* 
+ * freezer_write - Freeze or thaw the cgroup of job. Safe in a signal
+ *     handler. Returns 0, or -1 if it could not be written.
+ */
+int 
+freezer_write(struct job_t *job, int frozen) 
+{
+    char path[48];
+    int fd, n;
+
+    sio_ltoa(job->cgid, path, 10);
+    strcat(path, "/cgroup.freeze");
+    if ((fd = openat(freezerfd, path, O_WRONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = write(fd, frozen ? "1" : "0", 1);
+    close(fd);
+    return n == 1 ? 0 : -1;
+}
+
+/* freezer_fds - Add the cgroup.events of freezing jobs to pfd */
+int 
+freezer_fds(struct pollfd *pfd) 
+{
+    int i, n = 0;
+
+    for (i = 0; i < MAXJOBS; i++)
+        if (job_list[i].freezing && job_list[i].eventsfd >= 0) {
+            pfd[n].fd = job_list[i].eventsfd;
+            pfd[n++].events = POLLPRI;
+        }
+    return n;
+}
+
+/* 
+ * freezer_run - Stop the jobs whose cgroup.events says they are now
+ *     frozen. Reading the file also rearms its poll notification.
+ */
+void 
+freezer_run(void) 
+{
+    sigset_t mask_all, prev;
+    struct job_t *job;
+    char buf[256], *p;
+    ssize_t n;
+    int i;
+
+    Sigfillset(&mask_all);
+    Sigprocmask(SIG_BLOCK, &mask_all, &prev);
+    for (i = 0; i < MAXJOBS; i++) {
+        job = &job_list[i];
+        if (!job->freezing || job->eventsfd < 0)
+            continue;
+        if ((n = pread(job->eventsfd, buf, sizeof(buf) - 1, 0)) < 0)
+            continue;
+        buf[n] = '\0';
+        if ((p = strstr(buf, "frozen ")) == NULL || p[7] != '1')
+            continue;
+
+        job->freezing = 0;
+        job->state = ST;
+        job->stopped = 1;
+        job->stop_ms = now_ms();
+        reclaim_due = 1;
+        if (human()) {
+            sprintf(sbuf, "Job [%d] (%d) frozen\n", job->jid, job->pid);
+            sio_puts(sbuf);
+        }
+        notice("stop", job, "frozen", 1);
+    }
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* job_resume - Continue a stopped job: thaw its cgroup and SIGCONT it */
+void 
+job_resume(struct job_t *job) 
+{
+    if (job->cgid)
+        freezer_write(job, 0);
+    job->freezing = 0;
+    kill(-job->pid, SIGCONT);
+}
+/******************************
+ * end freezer routines
+ ******************************/
+
+/***********************************************
+ * Script routines
+ **********************************************/
+
+/* 
+ * script_lookup - Return the entry of script_list for the program cmd
+ *     if it is a tsh script to run in-process, else NULL
+ */
+struct script_t *
+script_lookup(const char *cmd) 
+{
+    static struct stat self;  /* this tsh binary */
+    struct script_t *sc = NULL;
+    struct stat st, interp;
+    char line[MAXLINE], *p, *q;
+    ssize_t n;
+    int i, fd;
+
+    if (stat(cmd, &st) < 0 || !S_ISREG(st.st_mode) || access(cmd, X_OK) < 0)
+        return NULL;
+
+    for (i = 0; i < MAXSCRIPTS && sc == NULL; i++)
+        if (!strcmp(script_list[i].path, cmd))
+            sc = &script_list[i];
+    if (sc && sc->dev == st.st_dev && sc->ino == st.st_ino
+        && sc->mtime.tv_sec == st.st_mtim.tv_sec
+        && sc->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return sc->tsh ? sc : NULL;
+
+    /* New or changed: read its #! line */
+    if (sc == NULL) {
+        sc = &script_list[script_next];
+        script_next = (script_next + 1) % MAXSCRIPTS;
+    }
+    snprintf(sc->path, MAXLINE, "%s", cmd);
+    sc->dev = st.st_dev;
+    sc->ino = st.st_ino;
+    sc->mtime = st.st_mtim;
+    sc->tsh = 0;
+    if (self.st_ino == 0 && stat("/proc/self/exe", &self) < 0)
+        return NULL;
+    if ((fd = open(cmd, O_RDONLY | O_CLOEXEC)) < 0)
+        return NULL;
+    n = read(fd, line, MAXLINE - 1);
+    close(fd);
+    if (n < 2 || line[0] != '#' || line[1] != '!')
+        return NULL;
+    line[n] = '\0';
+    line[strcspn(line, "\n")] = '\0';
+
+    /* An argument to the interpreter is left to execve and getopt */
+    p = line + 2 + strspn(line + 2, " \t");
+    q = p + strcspn(p, " \t");
+    if (q[strspn(q, " \t")] != '\0')
+        return NULL;
+    *q = '\0';
+    sc->tsh = stat(p, &interp) == 0 && interp.st_dev == self.st_dev
+        && interp.st_ino == self.st_ino;
+    return sc->tsh ? sc : NULL;
+}
+
+/* 
+ * script_open - Read commands from the script argv[0], and set $0 to
+ *     $9 from argv. Returns 0, or -1 after printing an error.
+ */
+int 
+script_open(int argc, char **argv) 
+{
+    char name[4];
+    int i;
+
+    if ((inputfd = open(argv[0], O_RDONLY | O_CLOEXEC)) < 0) {
+        report_error(argv[0], ": ", strerror(errno), "\n", NULL);
+        return -1;
+    }
+    inlen = 0;
+    for (i = 0; i < argc && i < 10; i++) {
+        sprintf(name, "%d", i);
+        setvar(name, argv[i]);
+    }
+    return 0;
+}
+
+/* 
+ * script_exec - Run the tsh script argv[0] in this forked child, as if
+ *     execve had started a new tsh on it. Never returns.
+ */
+void 
+script_exec(int argc, char **argv) 
+{
+    int i;
+
+    /* Forget the parent's jobs, timers, variables and options */
+    for (i = 0; i < MAXJOBS; i++) {
+        job_list[i].cgid = 0;  /* the parent removes its cgroups */
+        clearjob(&job_list[i]);
+    }
+    nextjid = 1;
+    lastbg = 0;
+    if (timerfd >= 0)
+        close(timerfd);
+    timerfd = -1;
+    memset(timer_list, 0, sizeof(timer_list));
+    memset(wheel, 0, sizeof(wheel));
+    memset(&reclaim_timer, 0, sizeof(reclaim_timer));
+    if (recordfd >= 0)
+        close(recordfd);
+    recordfd = -1;
+    if (freezerfd >= 0)
+        close(freezerfd);
+    freezerfd = -1;
+    if (reclaim_stats != NULL)
+        munmap(reclaim_stats, MAXJOBS * sizeof(struct reclaim_t));
+    reclaim_stats = NULL;
+    reclaim_grace = -1;
+    reclaim_due = 0;
+    maxjobs = 0;
+    curpool = -1;
+    verbose = pipelines = json = freezer = perfcount = 0;
+    lastrun_pgid = 0;
+    jsonfd = -1;
+    for (i = 0; i < MAXVARS; i++)
+        var_list[i].name[0] = '\0';
+    for (i = 0; i < MAXARRAYS; i++)
+        if (array_list[i].name[0] != '\0')
+            deletearray(&array_list[i]);
+
+    /* And start up the way main does */
+    dup2(1, 2);
+    init_signals();
+    if (script_open(argc, argv) < 0)
+        exit(1);
+    shell_loop(0);
+}
+/******************************
+ * end script routines
+ ******************************/
 
-    if(pid) /* If foreground job exist */
-        kill(-pid, sig);
-    /* 
-    * Since the shell will wait foreground job terminate,
-    * so we just let sigchld_handler to delete jobs and
-    * print message
-    */
-    Sigprocmask(SIG_SETMASK, &prev, NULL); /* Unblock signals */
+/***********************************************
+ * Performance counter routines
+ **********************************************/
 
-    errno = olderrno;
+/* 
+ * perf_open - Open the counters of perfdefs on process pid and all it
+ *     will start, leaving -1 in fd for those that cannot be had
+ */
+void 
+perf_open(pid_t pid, int fd[NPERF]) 
+{
+    struct perf_event_attr attr;
+    int k, j;
 
-    return;
+    for (k = 0; k < NPERF; k++) {
+        fd[k] = -1;
+        if (perf_denied || (perf_absent & (1 << k)))
+            continue;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perfdefs[k].type;
+        attr.config = perfdefs[k].config;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+            | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fd[k] = syscall(SYS_perf_event_open, &attr, pid, -1, -1,
+                        PERF_FLAG_FD_CLOEXEC);
+        if (fd[k] >= 0)
+            continue;
+        if (errno == EACCES || errno == EPERM) { /* Say so once */
+            perf_denied = 1;
+            report_error("perf_event_open: ", strerror(errno),
+                         " (see kernel.perf_event_paranoid), timing only\n", NULL);
+            for (j = 0; j < k; j++)
+                if (fd[j] >= 0) {
+                    close(fd[j]);
+                    fd[j] = -1;
+                }
+        }
+        else if (errno == ENOENT || errno == EOPNOTSUPP || errno == ENODEV)
+            perf_absent |= 1 << k; /* No such counter, e.g. no PMU in a VM */
+    }
 }
 
-/*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.  
+/* 
+ * perf_value - Read a counter, scaled up for the time it was not
+ *     scheduled on the PMU, or -1. Safe in a signal handler.
+ */
+static long long 
+perf_value(int fd) 
+{
+    unsigned long long v[3]; /* value, time enabled, time running */
+
+    if (read(fd, v, sizeof(v)) != sizeof(v))
+        return -1;
+    if (v[2] == 0)
+        return 0;
+    if (v[2] < v[1])
+        return (long long) ((double) v[0] * v[1] / v[2]);
+    return v[0];
+}
+
+/* 
+ * perf_reap - Add what the reaped process i of job used, its counters
+ *     and its rusage, to job->run and close the counters. Safe in a
+ *     signal handler.
  */
 void 
-sigtstp_handler(int sig) 
+perf_reap(struct job_t *job, int i, struct rusage *ru) 
 {
-    /* Declare and initialize variables */
-    int olderrno = errno, jid;
-    sigset_t mask_all, prev;
-    pid_t pid;
-    struct job_t *job;
-    pid = fgpid(job_list); /* Get foreground job's pid */
-    jid = pid2jid(pid); /* Get foreground job's jid */
-    job = getjobpid(job_list,pid); /* Get job */
-    Sigfillset(&mask_all);
-    Sigprocmask(SIG_BLOCK, &mask_all, &prev);
-    
-    if(pid) /* If foreground job exist */
-    {
-        /* 
-        * The shell will wait foreground job terminate,
-        * so we must print message and change the state
-        * here. As for child stopped for other reasons,
-        * we leave the job for sigchld_handler.
-        */
-        sio_puts("Job [");
-        sio_putl(jid);
-        sio_puts("] (");
-        sio_putl(pid);
-        sio_puts(") stopped by signal ");
-        sio_putl(sig);
-        sio_puts("\n");
-        job->state = ST;
-        /* Send signals */
-        kill(-pid, sig);
-        
+    long long v;
+    int k;
+
+    for (k = 0; k < NPERF; k++) {
+        if (job->perffd[i][k] < 0)
+            continue;
+        if ((v = perf_value(job->perffd[i][k])) >= 0)
+            job->run.count[k] = (job->run.count[k] < 0 ? 0 : job->run.count[k]) + v;
+        close(job->perffd[i][k]);
+        job->perffd[i][k] = -1;
     }
-    Sigprocmask(SIG_SETMASK, &prev, NULL); /* Unblock signals */
+    job->run.utime_us += ru->ru_utime.tv_sec * 1000000L + ru->ru_utime.tv_usec;
+    job->run.stime_us += ru->ru_stime.tv_sec * 1000000L + ru->ru_stime.tv_usec;
+}
+
+/* 
+ * job_runstats - Put in r what job used so far, the reaped processes
+ *     and the counters of the live ones. Return true if it is counted.
+ */
+int 
+job_runstats(struct job_t *job, struct runstats_t *r) 
+{
+    long long v;
+    int i, k, counted = 0;
+
+    *r = job->run;
+    for (k = 0; k < NPERF; k++)
+        counted |= r->count[k] >= 0;
+    for (i = 0; i < job->nprocs; i++)
+        for (k = 0; k < NPERF; k++) {
+            if (job->perffd[i][k] < 0)
+                continue;
+            counted = 1;
+            if ((v = perf_value(job->perffd[i][k])) >= 0)
+                r->count[k] = (r->count[k] < 0 ? 0 : r->count[k]) + v;
+        }
+    return counted;
+}
+
+/* 
+ * runstats_print - Print r, each line after indent: the times if times
+ *     is set, then the counters and the ratios they give
+ */
+void 
+runstats_print(struct runstats_t *r, int fd, const char *indent, int times) 
+{
+    char buf[MAXLINE];
+    long long *c = r->count;
+    size_t n = 0;
+    int k, counted = 0;
+
+    buf[0] = '\0';
+    if (times)
+        n += snprintf(buf + n, sizeof(buf) - n,
+                      "%sreal %ld.%03lds  user %ld.%03lds  sys %ld.%03lds\n", indent,
+                      r->real_ms / 1000, r->real_ms % 1000,
+                      r->utime_us / 1000000, r->utime_us / 1000 % 1000,
+                      r->stime_us / 1000000, r->stime_us / 1000 % 1000);
+    for (k = 0; k < NPERF; k++)
+        counted |= c[k] >= 0;
+    if (counted) {
+        n += snprintf(buf + n, sizeof(buf) - n, "%s", indent);
+        for (k = 0; k < NPERF; k++) {
+            if (k == PC_TASKCLOCK && c[k] >= 0)
+                n += snprintf(buf + n, sizeof(buf) - n, "%s %lld.%03lld ms",
+                              perfdefs[k].name, c[k] / 1000000, c[k] / 1000 % 1000);
+            else if (c[k] >= 0)
+                n += snprintf(buf + n, sizeof(buf) - n, ", %s %lld",
+                              perfdefs[k].name, c[k]);
+            else
+                n += snprintf(buf + n, sizeof(buf) - n, "%s%s n/a",
+                              k ? ", " : "", perfdefs[k].name);
+        }
+        n += snprintf(buf + n, sizeof(buf) - n, "\n");
+    }
+    if (c[PC_INSTRUCTIONS] > 0 && (c[PC_CYCLES] > 0 || c[PC_CACHEMISSES] >= 0
+                                   || c[PC_BRANCHMISSES] >= 0)) {
+        n += snprintf(buf + n, sizeof(buf) - n, "%s", indent);
+        if (c[PC_CYCLES] > 0)
+            n += snprintf(buf + n, sizeof(buf) - n, "%.2f insn per cycle",
+                          (double) c[PC_INSTRUCTIONS] / c[PC_CYCLES]);
+        for (k = PC_CACHEMISSES; k <= PC_BRANCHMISSES; k++)
+            if (c[k] >= 0)
+                n += snprintf(buf + n, sizeof(buf) - n, "%s%.2f %s per 1k insn",
+                              c[PC_CYCLES] > 0 || k > PC_CACHEMISSES ? ", " : "",
+                              1000.0 * c[k] / c[PC_INSTRUCTIONS], perfdefs[k].name);
+        n += snprintf(buf + n, sizeof(buf) - n, "\n");
+    }
+    if (n > 0 && write(fd, buf, strlen(buf)) < 0) {
+        fprintf(stderr, "Error writing to output file\n");
+        exit(1);
+    }
+}
+
+/* runstats_json - Add r to a JSON line, with the times if times is set */
+void 
+runstats_json(struct jw_t *w, struct runstats_t *r, int times) 
+{
+    int k;
+
+    if (times) {
+        jw_int(w, "real_ms", r->real_ms);
+        jw_int(w, "user_us", r->utime_us);
+        jw_int(w, "sys_us", r->stime_us);
+    }
+    for (k = 0; k < NPERF; k++)
+        if (r->count[k] >= 0)
+            jw_int(w, perfdefs[k].key, r->count[k]);
+}
+
+/* time_report - Report what the command line under time used */
+void 
+time_report(struct runstats_t *r, const char *cmdline) 
+{
+    struct jw_t w;
+
+    if (json) {
+        jw_begin(&w, json_fd(STDOUT_FILENO), "time");
+        runstats_json(&w, r, 1);
+        jw_str(&w, "cmdline", cmdline);
+        jw_end(&w);
+    }
+    if (human())
+        runstats_print(r, STDOUT_FILENO, "", 1);
+}
+/******************************
+ * end performance counter routines
+ ******************************/
+
+/***********************************************
+ * Helper routines that manipulate shell variables
+ **********************************************/
+
+/* getvarent - Find a shell variable by name, NULL if it is not set */
+struct var_t
+*getvarent(const char *name) {
+    int i;
+
+    for (i = 0; i < MAXVARS; i++)
+        if (var_list[i].name[0] != '\0' && !strcmp(var_list[i].name, name))
+            return &var_list[i];
+    return NULL;
+}
+
+/* 
+ * getvar - Return the value of a shell variable, falling back to the
+ *     environment. Returns NULL if the name is set in neither.
+ */
+char 
+*getvar(const char *name) 
+{
+    struct var_t *var;
+    struct array_t *arr;
+    char *value;
+
+    if ((var = getvarent(name)) != NULL)
+        return var->value;
+    if ((arr = getarray(name)) != NULL)  /* $name is ${name[0]} */
+        return array_lookup(arr, "0", &value) < 0 ? NULL : value;
+    return getenv(name);
+}
+
+/* setvar - Set a shell variable, creating it if needed */
+int 
+setvar(const char *name, const char *value) 
+{
+    int i;
+    struct var_t *var;
+    struct array_t *arr;
+
+    if ((arr = getarray(name)) != NULL)  /* name=value sets ${name[0]} */
+        return array_set(arr, "0", value) == 0;
+    if (strlen(name) >= MAXNAME || strlen(value) >= MAXLINE) {
+        report_error("setvar: ", name, ": name or value too long\n", NULL);
+        return 0;
+    }
+    if ((var = getvarent(name)) == NULL) {
+        for (i = 0; i < MAXVARS; i++) {
+            if (var_list[i].name[0] == '\0') {
+                var = &var_list[i];
+                strcpy(var->name, name);
+                break;
+            }
+        }
+    }
+    if (var == NULL) {
+        report_error("Tried to create too many variables\n", NULL);
+        return 0;
+    }
+    strcpy(var->value, value);
+    return 1;
+}
+
+/* unsetvar - Remove a shell variable, if it is set */
+void 
+unsetvar(const char *name) 
+{
+    struct var_t *var;
+
+    if ((var = getvarent(name)) != NULL)
+        var->name[0] = '\0';
+}
+/******************************
+ * end shell variable routines
+ ******************************/
+
+/***********************************************
+ * Helper routines that manipulate array variables
+ **********************************************/
+
+/* arr_dup - Return a malloc'd copy of s */
+static char *arr_dup(const char *s)
+{
+    char *p = Malloc(strlen(s) + 1);
+
+    strcpy(p, s);
+    return p;
+}
+
+/* getarray - Find an array variable by name, NULL if there is none */
+struct array_t 
+*getarray(const char *name) 
+{
+    int i;
+
+    for (i = 0; i < MAXARRAYS; i++)
+        if (array_list[i].name[0] != '\0' && !strcmp(array_list[i].name, name))
+            return &array_list[i];
+    return NULL;
+}
+
+/* cleararray - Free every element of an array, leaving it empty */
+void 
+cleararray(struct array_t *arr) 
+{
+    size_t i;
+
+    if (arr->kind == ARR_INDEXED) {
+        for (i = 0; i < arr->len; i++)
+            free(arr->elems[i]);
+        free(arr->elems);
+    }
+    else {
+        for (i = 0; i < arr->cap; i++) {
+            if (arr->slots[i].key != NULL && arr->slots[i].key != arr_tombstone) {
+                free(arr->slots[i].key);
+                free(arr->slots[i].value);
+            }
+        }
+        free(arr->slots);
+    }
+    arr->elems = NULL;
+    arr->slots = NULL;
+    arr->count = arr->len = arr->cap = arr->used = 0;
+}
+
+/* 
+ * newarray - Return an empty array of the given kind called name,
+ *     clearing any array or shell variable of that name first.
+ */
+struct array_t 
+*newarray(const char *name, int kind) 
+{
+    struct array_t *arr;
+    int i;
+
+    if ((arr = getarray(name)) != NULL) {
+        cleararray(arr);
+        arr->kind = kind;
+        return arr;
+    }
+    if (strlen(name) >= MAXNAME) {
+        report_error("newarray: ", name, ": name too long\n", NULL);
+        return NULL;
+    }
+    unsetvar(name);
+    for (i = 0; i < MAXARRAYS; i++) {
+        if (array_list[i].name[0] == '\0') {
+            arr = &array_list[i];
+            strcpy(arr->name, name);
+            arr->kind = kind;
+            return arr;
+        }
+    }
+    report_error("Tried to create too many arrays\n", NULL);
+    return NULL;
+}
+
+/* deletearray - Free an array and release its slot */
+void 
+deletearray(struct array_t *arr) 
+{
+    cleararray(arr);
+    arr->name[0] = '\0';
+}
+
+/* 
+ * array_index - Evaluate the subscript of an indexed array; negative
+ *     values count back from the end. Returns -1 on a bad subscript.
+ */
+static int array_index(struct array_t *arr, const char *sub, size_t *index)
+{
+    long long i;
+
+    if (arith_eval(sub, &i) < 0)
+        return -1;
+    if (i < 0)
+        i += arr->len;
+    if (i < 0) {
+        report_error(arr->name, "[", sub, "]: bad array subscript\n", NULL);
+        return -1;
+    }
+    *index = i;
+    return 0;
+}
+
+/* 
+ * assoc_find - Find the slot for key in an associative array. With
+ *     insert set, return the slot key should go in (growing the table
+ *     first if needed); otherwise return NULL if key is absent.
+ */
+static struct arr_slot *assoc_find(struct array_t *arr, const char *key, int insert)
+{
+    struct arr_slot *slot, *tomb = NULL, *old;
+    size_t i, mask, oldcap;
+    unsigned long hash = 14695981039346656037ul;  /* FNV-1a */
+    const char *p;
+
+    /* Keep the load (live keys and tombstones) under 70% */
+    if (insert && (arr->used + 1) * 10 >= arr->cap * 7) {
+        old = arr->slots;
+        oldcap = arr->cap;
+        arr->cap = arr->count * 2 + 2 > oldcap ? (oldcap ? oldcap * 2 : 16) : oldcap;
+        arr->slots = Calloc(arr->cap, sizeof(struct arr_slot));
+        arr->used = 0;
+        for (i = 0; i < oldcap; i++) {
+            if (old[i].key != NULL && old[i].key != arr_tombstone) {
+                slot = assoc_find(arr, old[i].key, 1);
+                *slot = old[i];
+                arr->used++;
+            }
+        }
+        free(old);
+    }
+    if (arr->cap == 0)
+        return NULL;
+
+    for (p = key; *p; p++)
+        hash = (hash ^ (unsigned char) *p) * 1099511628211ul;
+    mask = arr->cap - 1;
+    for (i = hash & mask; ; i = (i + 1) & mask) {
+        slot = &arr->slots[i];
+        if (slot->key == NULL)
+            return insert ? (tomb ? tomb : slot) : NULL;
+        if (slot->key == arr_tombstone) {
+            if (tomb == NULL)
+                tomb = slot;
+        }
+        else if (!strcmp(slot->key, key))
+            return slot;
+    }
+}
+
+/* 
+ * array_lookup - Store the element of arr at subscript sub in *value,
+ *     or NULL if it is not set. Returns -1 on a bad subscript.
+ */
+int 
+array_lookup(struct array_t *arr, const char *sub, char **value) 
+{
+    struct arr_slot *slot;
+    size_t i;
+
+    *value = NULL;
+    if (arr->kind == ARR_ASSOC) {
+        if ((slot = assoc_find(arr, sub, 0)) != NULL)
+            *value = slot->value;
+        return 0;
+    }
+    if (array_index(arr, sub, &i) < 0)
+        return -1;
+    if (i < arr->len)
+        *value = arr->elems[i];
+    return 0;
+}
+
+/* 
+ * array_setindex - Set element i of an indexed array. Returns -1 if i
+ *     is beyond MAXINDEX, so the vector cannot grow without bound.
+ */
+static int array_setindex(struct array_t *arr, size_t i, const char *value)
+{
+    char num[24];
+    size_t cap;
+
+    if (i >= MAXINDEX) {
+        snprintf(num, sizeof(num), "%zu", i);
+        report_error(arr->name, "[", num, "]: array subscript out of range\n", NULL);
+        return -1;
+    }
+    if (i >= arr->cap) {
+        for (cap = arr->cap ? arr->cap * 2 : 8; cap <= i; cap *= 2)
+            ;
+        arr->elems = Realloc(arr->elems, cap * sizeof(char *));
+        memset(arr->elems + arr->cap, 0, (cap - arr->cap) * sizeof(char *));
+        arr->cap = cap;
+    }
+    if (arr->elems[i] != NULL)
+        free(arr->elems[i]);
+    else
+        arr->count++;
+    arr->elems[i] = arr_dup(value);
+    if (i >= arr->len)
+        arr->len = i + 1;
+    return 0;
+}
+
+/* array_set - Set the element of arr at subscript sub */
+int 
+array_set(struct array_t *arr, const char *sub, const char *value) 
+{
+    struct arr_slot *slot;
+    size_t i;
+
+    if (arr->kind == ARR_INDEXED) {
+        if (array_index(arr, sub, &i) < 0)
+            return -1;
+        return array_setindex(arr, i, value);
+    }
+
+    slot = assoc_find(arr, sub, 1);
+    if (slot->key != NULL && slot->key != arr_tombstone) {
+        free(slot->value);
+        slot->value = arr_dup(value);
+        return 0;
+    }
+    if (slot->key == NULL)
+        arr->used++;
+    arr->count++;
+    slot->key = arr_dup(sub);
+    slot->value = arr_dup(value);
+    return 0;
+}
+
+/* array_append - Add value after the last element of an indexed array */
+int 
+array_append(struct array_t *arr, const char *value) 
+{
+    if (arr->kind != ARR_INDEXED) {
+        report_error(arr->name, ": ", value,
+                     ": must use subscript when assigning associative array\n", NULL);
+        return -1;
+    }
+    return array_setindex(arr, arr->len, value);
+}
+
+/* array_unset - Remove the element of arr at subscript sub */
+int 
+array_unset(struct array_t *arr, const char *sub) 
+{
+    struct arr_slot *slot;
+    size_t i;
+
+    if (arr->kind == ARR_ASSOC) {
+        if ((slot = assoc_find(arr, sub, 0)) != NULL) {
+            free(slot->key);
+            free(slot->value);
+            slot->key = arr_tombstone;
+            slot->value = NULL;
+            arr->count--;
+        }
+        return 0;
+    }
+    if (array_index(arr, sub, &i) < 0)
+        return -1;
+    if (i < arr->len && arr->elems[i] != NULL) {
+        free(arr->elems[i]);
+        arr->elems[i] = NULL;
+        arr->count--;
+        while (arr->len > 0 && arr->elems[arr->len-1] == NULL)
+            arr->len--;
+    }
+    return 0;
+}
+
+/* 
+ * array_next - Iterate over the set elements of arr. *pos starts at 0.
+ *     Returns the next value and stores its key in *key (NULL for an
+ *     indexed array, whose index is *pos - 1), or NULL at the end.
+ */
+char 
+*array_next(struct array_t *arr, size_t *pos, char **key) 
+{
+    struct arr_slot *slot;
+
+    if (arr->kind == ARR_INDEXED) {
+        while (*pos < arr->len) {
+            *key = NULL;
+            if (arr->elems[(*pos)++] != NULL)
+                return arr->elems[*pos - 1];
+        }
+        return NULL;
+    }
+    while (*pos < arr->cap) {
+        slot = &arr->slots[(*pos)++];
+        if (slot->key != NULL && slot->key != arr_tombstone) {
+            *key = slot->key;
+            return slot->value;
+        }
+    }
+    return NULL;
+}
+/******************************
+ * end array variable routines
+ ******************************/
+
+/***********************************************
+ * Arithmetic expression compiler and evaluator
+ **********************************************/
 
-    errno = olderrno;
-    
-    return;
+/* Compiler state for one expression */
+struct arith_parser {
+    const char *p;              /* next unread character */
+    struct arith_code *code;    /* program being emitted */
+    const char *err;            /* first error seen, NULL if none */
+};
+
+/* Operators in longest-match order */
+static const char *arith_ops[] = {
+    "<<=", ">>=", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||",
+    "++", "--", "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=",
+    "+", "-", "*", "/", "%", "<", ">", "&", "^", "|", "!", "~",
+    "?", ":", "=", "(", ")", ",", NULL
+};
+
+/* Left-associative binary operators, from lowest to highest precedence */
+static const struct {
+    const char *ops[5];
+    int codes[5];
+} arith_levels[] = {
+    {{"|", NULL},                    {OP_BOR}},
+    {{"^", NULL},                    {OP_BXOR}},
+    {{"&", NULL},                    {OP_BAND}},
+    {{"==", "!=", NULL},             {OP_EQ, OP_NE}},
+    {{"<", "<=", ">", ">=", NULL},   {OP_LT, OP_LE, OP_GT, OP_GE}},
+    {{"<<", ">>", NULL},             {OP_SHL, OP_SHR}},
+    {{"+", "-", NULL},               {OP_ADD, OP_SUB}},
+    {{"*", "/", "%", NULL},          {OP_MUL, OP_DIV, OP_MOD}},
+};
+#define ARITH_NLEVELS (int) (sizeof(arith_levels) / sizeof(arith_levels[0]))
+
+static void arith_comma(struct arith_parser *ps);
+static void arith_assign(struct arith_parser *ps);
+
+/* arith_error - Record the first compile error */
+static void arith_error(struct arith_parser *ps, const char *msg)
+{
+    if (ps->err == NULL)
+        ps->err = msg;
 }
 
-/*
- * sigquit_handler - The driver program can gracefully terminate the
- *    child shell by sending it a SIGQUIT signal.
- */
-void 
-sigquit_handler(int sig) 
+/* arith_peek - Return the operator at the current position, or NULL */
+static const char *arith_peek(struct arith_parser *ps)
 {
-    sio_error("Terminating after receipt of SIGQUIT signal\n");
+    int i;
+
+    while (isspace((unsigned char) *ps->p))
+        ps->p++;
+    for (i = 0; arith_ops[i]; i++)
+        if (!strncmp(ps->p, arith_ops[i], strlen(arith_ops[i])))
+            return arith_ops[i];
+    return NULL;
 }
 
+/* arith_accept - Consume operator op if it comes next */
+static int arith_accept(struct arith_parser *ps, const char *op)
+{
+    const char *next = arith_peek(ps);
 
+    if (next == NULL || strcmp(next, op))
+        return 0;
+    ps->p += strlen(op);
+    return 1;
+}
 
-/*********************
- * End signal handlers
- *********************/
+/* arith_emit - Append an instruction, returning its index */
+static int arith_emit(struct arith_parser *ps, int op, long long arg)
+{
+    struct arith_code *code = ps->code;
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+    if (code->ninsns >= MAXCODE) {
+        arith_error(ps, "expression too long");
+        return 0;
+    }
+    code->insns[code->ninsns].op = op;
+    code->insns[code->ninsns].arg = arg;
+    return code->ninsns++;
+}
 
-/* clearjob - Clear the entries in a job struct */
-void 
-clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+/* arith_patch - Point the jump at index at to the next instruction */
+static void arith_patch(struct arith_parser *ps, int at)
+{
+    ps->code->insns[at].arg = ps->code->ninsns;
 }
 
-/* initjobs - Initialize the job list */
-void 
-initjobs(struct job_t *job_list) {
-    int i;
+/* 
+ * arith_name - Consume an identifier and intern it in the names pool.
+ *     Returns its offset, or -1 if no identifier comes next.
+ */
+static int arith_name(struct arith_parser *ps)
+{
+    struct arith_code *code = ps->code;
+    const char *start;
+    int len, off;
 
-    for (i = 0; i < MAXJOBS; i++)
-        clearjob(&job_list[i]);
+    while (isspace((unsigned char) *ps->p))
+        ps->p++;
+    if (!isalpha((unsigned char) *ps->p) && *ps->p != '_')
+        return -1;
+    for (start = ps->p; isalnum((unsigned char) *ps->p) || *ps->p == '_'; ps->p++)
+        ;
+    len = ps->p - start;
+
+    /* Reuse the name if it was seen before in this expression */
+    for (off = 0; off < code->namelen; off += strlen(code->names + off) + 1)
+        if ((int) strlen(code->names + off) == len
+            && !strncmp(code->names + off, start, len))
+            return off;
+
+    if (len >= MAXNAME || code->namelen + len + 1 > MAXLINE) {
+        arith_error(ps, "variable name too long");
+        return 0;
+    }
+    off = code->namelen;
+    memcpy(code->names + off, start, len);
+    code->names[off + len] = '\0';
+    code->namelen += len + 1;
+    return off;
 }
 
-/* maxjid - Returns largest allocated job ID */
-int 
-maxjid(struct job_t *job_list) 
+/* arith_primary - number, variable, (expr), with postfix ++ and -- */
+static void arith_primary(struct arith_parser *ps)
 {
-    int i, max=0;
-
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].jid > max)
-            max = job_list[i].jid;
-    return max;
+    char *end;
+    long long v;
+    int name;
+
+    if (arith_accept(ps, "(")) {
+        arith_comma(ps);
+        if (!arith_accept(ps, ")"))
+            arith_error(ps, "missing )");
+        return;
+    }
+    if (isdigit((unsigned char) *ps->p)) {
+        errno = 0;
+        v = strtoll(ps->p, &end, 0);
+        if (errno || isalnum((unsigned char) *end) || *end == '_')
+            arith_error(ps, "bad number");
+        ps->p = end;
+        arith_emit(ps, OP_NUM, v);
+        return;
+    }
+    if ((name = arith_name(ps)) < 0) {
+        arith_error(ps, "syntax error");
+        return;
+    }
+    arith_emit(ps, OP_LOAD, name);
+    if (arith_accept(ps, "++") || arith_accept(ps, "--")) {
+        /* Postfix: leave the old value, store the new one */
+        arith_emit(ps, OP_LOAD, name);
+        arith_emit(ps, OP_NUM, ps->p[-1] == '+' ? 1 : -1);
+        arith_emit(ps, OP_ADD, 0);
+        arith_emit(ps, OP_STORE, name);
+        arith_emit(ps, OP_POP, 0);
+    }
 }
 
-/* addjob - Add a job to the job list */
-int 
-addjob(struct job_t *job_list, pid_t pid, int state, char *cmdline) 
+/* arith_unary - prefix operators ! ~ - + ++ -- */
+static void arith_unary(struct arith_parser *ps)
 {
-    int i;
+    int name;
 
-    if (pid < 1)
-        return 0;
+    if (arith_accept(ps, "++") || arith_accept(ps, "--")) {
+        long long delta = ps->p[-1] == '+' ? 1 : -1;
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (job_list[i].pid == 0) {
-            job_list[i].pid = pid;
-            job_list[i].state = state;
-            job_list[i].jid = nextjid++;
-            if (nextjid > MAXJOBS)
-                nextjid = 1;
-            strcpy(job_list[i].cmdline, cmdline);
-            if(verbose){
-                printf("Added job [%d] %d %s\n",
-                       job_list[i].jid,
-                       job_list[i].pid,
-                       job_list[i].cmdline);
-            }
-            return 1;
+        if ((name = arith_name(ps)) < 0) {
+            arith_error(ps, "++ or -- needs a variable");
+            return;
         }
+        arith_emit(ps, OP_LOAD, name);
+        arith_emit(ps, OP_NUM, delta);
+        arith_emit(ps, OP_ADD, 0);
+        arith_emit(ps, OP_STORE, name);
     }
-    printf("Tried to create too many jobs\n");
-    return 0;
+    else if (arith_accept(ps, "!")) {
+        arith_unary(ps);
+        arith_emit(ps, OP_NOT, 0);
+    }
+    else if (arith_accept(ps, "~")) {
+        arith_unary(ps);
+        arith_emit(ps, OP_BNOT, 0);
+    }
+    else if (arith_accept(ps, "-")) {
+        arith_unary(ps);
+        arith_emit(ps, OP_NEG, 0);
+    }
+    else if (arith_accept(ps, "+"))
+        arith_unary(ps);
+    else
+        arith_primary(ps);
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int 
-deletejob(struct job_t *job_list, pid_t pid) 
+/* arith_binary - left-associative operators at arith_levels[level] and up */
+static void arith_binary(struct arith_parser *ps, int level)
 {
-    int i;
-
-    if (pid < 1)
-        return 0;
+    const char *op;
+    int i, matched;
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (job_list[i].pid == pid) {
-            clearjob(&job_list[i]);
-            nextjid = maxjid(job_list)+1;
-            return 1;
+    if (level >= ARITH_NLEVELS) {
+        arith_unary(ps);
+        return;
+    }
+    arith_binary(ps, level + 1);
+    do {
+        matched = 0;
+        if ((op = arith_peek(ps)) == NULL)
+            break;
+        for (i = 0; arith_levels[level].ops[i]; i++) {
+            if (!strcmp(op, arith_levels[level].ops[i])) {
+                ps->p += strlen(op);
+                arith_binary(ps, level + 1);
+                arith_emit(ps, arith_levels[level].codes[i], 0);
+                matched = 1;
+                break;
+            }
         }
+    } while (matched && ps->err == NULL);
+}
+
+/* arith_and - logical and with short-circuit evaluation */
+static void arith_and(struct arith_parser *ps)
+{
+    int jz, jmp;
+
+    arith_binary(ps, 0);
+    while (ps->err == NULL && arith_accept(ps, "&&")) {
+        jz = arith_emit(ps, OP_JZ, 0);
+        arith_binary(ps, 0);
+        arith_emit(ps, OP_BOOL, 0);
+        jmp = arith_emit(ps, OP_JMP, 0);
+        arith_patch(ps, jz);
+        arith_emit(ps, OP_NUM, 0);
+        arith_patch(ps, jmp);
     }
-    return 0;
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t 
-fgpid(struct job_t *job_list) {
-    int i;
+/* arith_or - logical or with short-circuit evaluation */
+static void arith_or(struct arith_parser *ps)
+{
+    int jnz, jmp;
+
+    arith_and(ps);
+    while (ps->err == NULL && arith_accept(ps, "||")) {
+        jnz = arith_emit(ps, OP_JNZ, 0);
+        arith_and(ps);
+        arith_emit(ps, OP_BOOL, 0);
+        jmp = arith_emit(ps, OP_JMP, 0);
+        arith_patch(ps, jnz);
+        arith_emit(ps, OP_NUM, 1);
+        arith_patch(ps, jmp);
+    }
+}
 
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].state == FG)
-            return job_list[i].pid;
-    return 0;
+/* arith_cond - the ?: operator */
+static void arith_cond(struct arith_parser *ps)
+{
+    int jz, jmp;
+
+    arith_or(ps);
+    if (ps->err == NULL && arith_accept(ps, "?")) {
+        jz = arith_emit(ps, OP_JZ, 0);
+        arith_comma(ps);
+        if (!arith_accept(ps, ":"))
+            arith_error(ps, "missing : in ?:");
+        jmp = arith_emit(ps, OP_JMP, 0);
+        arith_patch(ps, jz);
+        arith_assign(ps);
+        arith_patch(ps, jmp);
+    }
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t 
-*getjobpid(struct job_t *job_list, pid_t pid) {
-    int i;
+/* arith_assign - = and the compound assignment operators */
+static void arith_assign(struct arith_parser *ps)
+{
+    static const char *ops[] = {"*=", "/=", "%=", "+=", "-=", "<<=", ">>=",
+                                "&=", "^=", "|=", NULL};
+    static const int codes[] = {OP_MUL, OP_DIV, OP_MOD, OP_ADD, OP_SUB, OP_SHL,
+                                OP_SHR, OP_BAND, OP_BXOR, OP_BOR};
+    const char *start = ps->p, *op;
+    int name, i;
+
+    if ((name = arith_name(ps)) >= 0 && (op = arith_peek(ps)) != NULL) {
+        if (!strcmp(op, "=")) {
+            ps->p += 1;
+            arith_assign(ps);
+            arith_emit(ps, OP_STORE, name);
+            return;
+        }
+        for (i = 0; ops[i]; i++) {
+            if (!strcmp(op, ops[i])) {
+                ps->p += strlen(op);
+                arith_emit(ps, OP_LOAD, name);
+                arith_assign(ps);
+                arith_emit(ps, codes[i], 0);
+                arith_emit(ps, OP_STORE, name);
+                return;
+            }
+        }
+    }
 
-    if (pid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].pid == pid)
-            return &job_list[i];
-    return NULL;
+    /* Not an assignment; rescan as a conditional expression */
+    ps->p = start;
+    arith_cond(ps);
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *job_list, int jid) 
+/* arith_comma - the comma operator, the top of the grammar */
+static void arith_comma(struct arith_parser *ps)
 {
-    int i;
+    arith_assign(ps);
+    while (ps->err == NULL && arith_accept(ps, ",")) {
+        arith_emit(ps, OP_POP, 0);
+        arith_assign(ps);
+    }
+}
 
-    if (jid < 1)
+/* 
+ * arith_compile - Return the compiled program for expr, compiling it
+ *     only if it is not already in arith_cache. Returns NULL after
+ *     printing an error if expr is malformed.
+ */
+struct arith_code 
+*arith_compile(const char *expr) 
+{
+    struct arith_parser ps;
+    struct arith_code *code;
+    unsigned int hash = 2166136261u;  /* FNV-1a */
+    const char *p;
+
+    if (strlen(expr) >= MAXLINE) {
+        report_error("arithmetic: expression too long\n", NULL);
         return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].jid == jid)
-            return &job_list[i];
-    return NULL;
+    }
+    for (p = expr; *p; p++)
+        hash = (hash ^ (unsigned char) *p) * 16777619u;
+    code = &arith_cache[hash % ARITHCACHE];
+    if (code->src[0] != '\0' && !strcmp(code->src, expr))
+        return code;
+
+    code->src[0] = '\0';
+    code->ninsns = 0;
+    code->namelen = 0;
+    ps.p = expr;
+    ps.code = code;
+    ps.err = NULL;
+
+    arith_comma(&ps);
+    if (ps.err == NULL && arith_peek(&ps) == NULL && *ps.p != '\0')
+        arith_error(&ps, "syntax error");
+    else if (ps.err == NULL && *ps.p != '\0')
+        arith_error(&ps, "unexpected operator");
+    if (ps.err == NULL && code->ninsns == 0)
+        arith_error(&ps, "empty expression");
+    if (ps.err != NULL) {
+        report_error((char *) expr, ": arithmetic ", ps.err, "\n", NULL);
+        return NULL;
+    }
+    strcpy(code->src, expr);
+    return code;
 }
 
-/* pid2jid - Map process ID to job ID */
+/* 
+ * arith_run - Execute a compiled expression. Returns 0 and stores the
+ *     value in result, or -1 after printing an error.
+ */
 int 
-pid2jid(pid_t pid) 
+arith_run(struct arith_code *code, long long *result) 
 {
-    int i;
+    long long stack[MAXCODE];
+    int sp = 0, pc;
+    long long a, b;
+    char *name, *value, *end;
+    char num[32];
+    struct arith_insn *in;
+
+    for (pc = 0; pc < code->ninsns; pc++) {
+        in = &code->insns[pc];
+        switch (in->op) {
+        case OP_NUM:
+            stack[sp++] = in->arg;
+            continue;
+        case OP_LOAD:
+            name = code->names + in->arg;
+            value = getvar(name);
+            if (value == NULL || *value == '\0') {
+                stack[sp++] = 0;
+                continue;
+            }
+            errno = 0;
+            stack[sp++] = strtoll(value, &end, 0);
+            if (errno || *end != '\0') {
+                report_error(name, ": ", value, ": bad number\n", NULL);
+                return -1;
+            }
+            continue;
+        case OP_STORE:
+            sprintf(num, "%lld", stack[sp-1]);
+            if (!setvar(code->names + in->arg, num))
+                return -1;
+            continue;
+        case OP_POP:
+            sp--;
+            continue;
+        case OP_JZ:
+            if (stack[--sp] == 0)
+                pc = in->arg - 1;
+            continue;
+        case OP_JNZ:
+            if (stack[--sp] != 0)
+                pc = in->arg - 1;
+            continue;
+        case OP_JMP:
+            pc = in->arg - 1;
+            continue;
+        case OP_BOOL:
+            stack[sp-1] = stack[sp-1] != 0;
+            continue;
+        case OP_NEG:
+            stack[sp-1] = -(unsigned long long) stack[sp-1];
+            continue;
+        case OP_NOT:
+            stack[sp-1] = !stack[sp-1];
+            continue;
+        case OP_BNOT:
+            stack[sp-1] = ~stack[sp-1];
+            continue;
+        }
 
-    if (pid < 1)
-        return 0;
-    for (i = 0; i < MAXJOBS; i++)
-        if (job_list[i].pid == pid) {
-            return job_list[i].jid;
+        /* Binary operators */
+        b = stack[--sp];
+        a = stack[sp-1];
+        switch (in->op) {
+        case OP_DIV:
+        case OP_MOD:
+            if (b == 0) {
+                report_error(code->src, ": division by 0\n", NULL);
+                return -1;
+            }
+            if (a == LLONG_MIN && b == -1)  /* the one overflowing case */
+                a = in->op == OP_DIV ? LLONG_MIN : 0;
+            else
+                a = in->op == OP_DIV ? a / b : a % b;
+            break;
+        case OP_MUL:  a = (unsigned long long) a * b; break;
+        case OP_ADD:  a = (unsigned long long) a + b; break;
+        case OP_SUB:  a = (unsigned long long) a - b; break;
+        case OP_SHL:  a = (unsigned long long) a << (b & 63); break;
+        case OP_SHR:  a = a >> (b & 63); break;
+        case OP_LT:   a = a < b;  break;
+        case OP_LE:   a = a <= b; break;
+        case OP_GT:   a = a > b;  break;
+        case OP_GE:   a = a >= b; break;
+        case OP_EQ:   a = a == b; break;
+        case OP_NE:   a = a != b; break;
+        case OP_BAND: a = a & b;  break;
+        case OP_BXOR: a = a ^ b;  break;
+        case OP_BOR:  a = a | b;  break;
         }
+        stack[sp-1] = a;
+    }
+    *result = stack[sp-1];
     return 0;
 }
 
-/* listjobs - Print the job list */
-void 
-listjobs(struct job_t *job_list, int output_fd) 
+/* arith_eval - Compile (or fetch from the cache) and run expr */
+int 
+arith_eval(const char *expr, long long *result) 
 {
-    int i;
-    char buf[MAXLINE + 1];
+    struct arith_code *code;
 
-    for (i = 0; i < MAXJOBS; i++) {
-        memset(buf, '\0', MAXLINE);
-        if (job_list[i].pid != 0) {
-            sprintf(buf, "[%d] (%d) ", job_list[i].jid, job_list[i].pid);
-            if(write(output_fd, buf, strlen(buf)) < 0) {
-                fprintf(stderr, "Error writing to output file\n");
-                exit(1);
-            }
-            memset(buf, '\0', MAXLINE);
-            switch (job_list[i].state) {
-            case BG:
-                sprintf(buf, "Running    ");
-                break;
-            case FG:
-                sprintf(buf, "Foreground ");
-                break;
-            case ST:
-                sprintf(buf, "Stopped    ");
-                break;
-            default:
-                sprintf(buf, "listjobs: Internal error: job[%d].state=%d ",
-                        i, job_list[i].state);
-            }
-            if(write(output_fd, buf, strlen(buf)) < 0) {
-                fprintf(stderr, "Error writing to output file\n");
-                exit(1);
+    if ((code = arith_compile(expr)) == NULL)
+        return -1;
+    return arith_run(code, result);
+}
+/******************************
+ * end arithmetic routines
+ ******************************/
+
+/***********************************************
+ * Pattern matching routines
+ **********************************************/
+
+/* 
+ * pattern_cached - Return the compiled pattern src, compiling it only
+ *     if it is not already in pattern_cache. NULL if it is too long.
+ */
+const struct pattern_t *
+pattern_cached(const char *src) 
+{
+    struct pattern_code *code;
+    unsigned int hash = 2166136261u;  /* FNV-1a */
+    const char *p;
+
+    if (strlen(src) >= MAXLINE)
+        return NULL;
+    for (p = src; *p; p++)
+        hash = (hash ^ (unsigned char) *p) * 16777619u;
+    code = &pattern_cache[hash % PATCACHE];
+    if (code->src[0] != '\0' && !strcmp(code->src, src))
+        return &code->pat;
+    code->src[0] = '\0';
+    if (pattern_compile(&code->pat, src) < 0)
+        return NULL;
+    strcpy(code->src, src);
+    return &code->pat;
+}
+
+/* 
+ * pattern_compile - Compile the shell pattern src (with *, ?, [...]
+ *     and backslash escapes) into pat. Returns 0 on success, -1 if the
+ *     pattern is too long.
+ */
+int 
+pattern_compile(struct pattern_t *pat, const char *src)
+{
+    const unsigned char *p = (const unsigned char *) src;
+    const unsigned char *q;
+    struct pat_item *item;
+    int c, negate;
+
+    pat->n = 0;
+    while (*p) {
+        if (pat->n >= MAXPAT)
+            return -1;
+        item = &pat->items[pat->n];
+
+        if (*p == '*') {
+            /* Consecutive stars are the same as one */
+            if (pat->n == 0 || pat->items[pat->n-1].type != PAT_STAR) {
+                item->type = PAT_STAR;
+                pat->n++;
             }
-            memset(buf, '\0', MAXLINE);
-            sprintf(buf, "%s\n", job_list[i].cmdline);
-            if(write(output_fd, buf, strlen(buf)) < 0) {
-                fprintf(stderr, "Error writing to output file\n");
-                exit(1);
+            p++;
+            continue;
+        }
+        if (*p == '?') {
+            item->type = PAT_ANY;
+            pat->n++;
+            p++;
+            continue;
+        }
+        if (*p == '[') {
+            /* A bracket expression; ']' right after '[' is literal */
+            q = p + 1;
+            negate = (*q == '!' || *q == '^');
+            q += negate;
+            if (*q == ']')
+                q++;
+            while (*q && *q != ']')
+                q++;
+            if (*q == ']') {
+                memset(item->set, 0, sizeof(item->set));
+                for (p += 1 + negate; p < q; p++) {
+                    if (p + 2 < q && p[1] == '-') {
+                        for (c = p[0]; c <= p[2]; c++)
+                            item->set[c >> 3] |= 1 << (c & 7);
+                        p += 2;
+                    }
+                    else
+                        item->set[*p >> 3] |= 1 << (*p & 7);
+                }
+                if (negate)
+                    for (c = 0; c < 32; c++)
+                        item->set[c] = ~item->set[c];
+                item->type = PAT_SET;
+                pat->n++;
+                p = q + 1;
+                continue;
             }
+            /* No closing ']', so '[' is an ordinary character */
+        }
+        if (*p == '\\' && p[1] != '\0')
+            p++;
+        item->type = PAT_CHAR;
+        item->c = *p++;
+        pat->n++;
+    }
+    return 0;
+}
+
+/* pattern_match - Return true if pat matches all len bytes of s */
+int 
+pattern_match(const struct pattern_t *pat, const char *s, size_t len)
+{
+    const struct pat_item *item;
+    unsigned char c;
+    size_t si = 0, mark = 0;
+    int pi = 0, star = -1;
+
+    while (si < len) {
+        c = (unsigned char) s[si];
+        item = &pat->items[pi];
+        if (pi < pat->n && item->type == PAT_STAR) {
+            /* Try matching nothing first; backtrack here on failure */
+            star = pi++;
+            mark = si;
+            continue;
+        }
+        if (pi < pat->n
+            && (item->type == PAT_ANY
+                || (item->type == PAT_CHAR && item->c == c)
+                || (item->type == PAT_SET && (item->set[c >> 3] & (1 << (c & 7)))))) {
+            pi++;
+            si++;
+            continue;
         }
+        if (star < 0)
+            return 0;
+        /* Let the last star swallow one more character */
+        pi = star + 1;
+        si = ++mark;
     }
+    while (pi < pat->n && pat->items[pi].type == PAT_STAR)
+        pi++;
+    return pi == pat->n;
 }
 /******************************
- * end job list helper routines
+ * end pattern matching routines
  ******************************/
 
 /******************************
@@ -1113,6 +7186,33 @@ void Sio_error(char s[])
     sio_error(s);
 }
 
+void *Malloc(size_t size) 
+{
+    void *p;
+
+    if ((p  = malloc(size)) == NULL)
+	unix_error("Malloc error");
+    return p;
+}
+
+void *Realloc(void *ptr, size_t size) 
+{
+    void *p;
+
+    if ((p  = realloc(ptr, size)) == NULL)
+	unix_error("Realloc error");
+    return p;
+}
+
+void *Calloc(size_t nmemb, size_t size) 
+{
+    void *p;
+
+    if ((p = calloc(nmemb, size)) == NULL)
+	unix_error("Calloc error");
+    return p;
+}
+
 /**********************************
  * end helper routines from csapp.c
  **********************************/
@@ -1127,10 +7227,14 @@ void Sio_error(char s[])
 void 
 usage(void) 
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpJ] [-j fd] [-o option] [-r file] [script [args]]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -o   turn on a shell option (see set -o)\n");
+    printf("   -r   record the session as a trace for runtrace\n");
+    printf("   -J   report jobs, notices and errors in JSON lines\n");
+    printf("   -j   write JSON lines to fd, keeping the usual output\n");
     exit(1);
 }
 
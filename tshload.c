@@ -0,0 +1,545 @@
+/*
+ * tshload.c - Shell lab load generator
+ *
+ * Runs many tiny shells at once, each driven like runtrace drives one:
+ * commands go in over a datagram socket pair, the shell's output comes
+ * back on it, and jobs such as myspin1 synchronize over SYNCFD. Every
+ * session sends a random mix of builtins, short foreground commands,
+ * background bursts and signals to foreground jobs, and measures the
+ * prompt latency: the time from sending a command (or a signal) until
+ * the next prompt arrives.
+ *
+ * For each number of sessions it prints the aggregate throughput and
+ * the percentiles of all prompt latencies, and of the per-session 99th
+ * percentiles. With -C the shells run in a cgroup limited to a share
+ * of one CPU, to see how they behave on a contended host.
+ *
+ * Usage: tshload [-hV] [-s shell] [-n n1,n2,...] [-c cmds] [-m mix]
+ *                [-r seed] [-t secs] [-C percent]
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "config.h"
+
+#define MAXLEVELS  16     /* max session counts to try */
+#define BURST       4     /* background jobs started by one burst */
+
+/* Kinds of commands in the workload mix */
+#define CMD_BUILTIN  0    /* a builtin, run inside the shell */
+#define CMD_FG       1    /* a short foreground command */
+#define CMD_BURST    2    /* a burst of background commands */
+#define CMD_SIGNAL   3    /* ctrl-c or ctrl-z to a foreground job */
+#define NKINDS       4
+
+/*
+ * Global variables
+ */
+extern char **environ;
+char *shellprog = "./tshfast";
+int verbose = 0;
+int ncmds = 200;             /* commands per session */
+int timeout = 10;            /* seconds to wait for a prompt */
+unsigned seed = 1;
+int mix[NKINDS] = {40, 40, 10, 10}; /* weights of each kind */
+char cgroup[MAXBUF];         /* cgroup of the shells, empty for none */
+
+/* What each session reports back to the parent */
+struct result_t {
+    int done;                /* commands completed */
+    int errors;              /* timeouts and unexpected output */
+    double latency[1];       /* ncmds prompt latencies in us */
+};
+#define RESULT_SIZE (sizeof(struct result_t) + (ncmds - 1) * sizeof(double))
+
+/* One running shell, seen from its session driver */
+struct session_t {
+    int pid;                 /* the shell */
+    int datafd;              /* our end of its stdin and stdout */
+    int syncfd;              /* our end of its jobs' SYNCFD */
+    char out[MAXBUF];        /* output since the last prompt */
+    size_t outlen;
+};
+
+/* Prototypes */
+void usage(char *msg);
+double now_us(void);
+int readable(int fd, double secs);
+int session_start(struct session_t *s);
+void session_end(struct session_t *s);
+int send_line(struct session_t *s, char *line);
+int next_prompt(struct session_t *s);
+int run_command(struct session_t *s, int kind, int *counter);
+void run_session(int id, struct result_t *res);
+int cgroup_setup(int percent);
+void cgroup_join(void);
+int cmp_double(const void *a, const void *b);
+double percentile(double *v, int n, double p);
+void run_level(int nsessions);
+
+/* Main routine */
+int main(int argc, char **argv)
+{
+    int levels[MAXLEVELS] = {1, 10, 100};
+    int nlevels = 3, cpu = 0, i;
+    char c, *p;
+    struct stat statbuf;
+
+    while ((c = getopt(argc, argv, "hVs:n:c:m:r:t:C:")) != EOF) {
+        switch (c) {
+        case 'h':             /* Print help message */
+            usage("");
+            break;
+        case 'V':             /* Be more verbose */
+            verbose++;
+            break;
+        case 's':             /* The shell program name */
+            shellprog = strdup(optarg);
+            break;
+        case 'n':             /* Session counts, e.g. 1,10,100 */
+            for (nlevels = 0, p = optarg; *p && nlevels < MAXLEVELS; nlevels++) {
+                if ((levels[nlevels] = strtol(p, &p, 10)) <= 0)
+                    usage("Session counts must be positive");
+                if (*p == ',')
+                    p++;
+            }
+            break;
+        case 'c':             /* Commands per session */
+            if ((ncmds = atoi(optarg)) <= 0)
+                usage("Command count must be positive");
+            break;
+        case 'm':             /* Workload mix, e.g. 40,40,10,10 */
+            for (i = 0, p = optarg; i < NKINDS; i++) {
+                mix[i] = strtol(p, &p, 10);
+                if (mix[i] < 0 || (*p != ',' && *p != '\0'))
+                    usage("Bad workload mix");
+                if (*p == ',')
+                    p++;
+            }
+            if (mix[0] + mix[1] + mix[2] + mix[3] == 0)
+                usage("Bad workload mix");
+            break;
+        case 'r':             /* Random seed */
+            seed = atoi(optarg);
+            break;
+        case 't':             /* Seconds to wait for a prompt */
+            timeout = atoi(optarg);
+            break;
+        case 'C':             /* Cap the shells at percent of one CPU */
+            cpu = atoi(optarg);
+            break;
+        default:
+            usage("Unrecognized argument");
+        }
+    }
+
+    /* Make sure the requested shell is executable */
+    if (stat(shellprog, &statbuf) < 0) {
+        fprintf(stderr, "%s: File not found\n", shellprog);
+        exit(1);
+    }
+    if (!(statbuf.st_mode & S_IXUSR)) {
+        fprintf(stderr, "%s: File is not executable\n", shellprog);
+        exit(1);
+    }
+
+    if (cpu > 0 && cgroup_setup(cpu) < 0)
+        fprintf(stderr, "tshload: no cgroup, running without a CPU cap\n");
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("%8s %8s %8s %10s %9s %9s %9s %9s %9s\n", "sessions", "cmds",
+           "secs", "cmds/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "s-p99 ms");
+    for (i = 0; i < nlevels; i++)
+        run_level(levels[i]);
+
+    if (cgroup[0] != '\0' && rmdir(cgroup) < 0 && verbose)
+        perror("rmdir cgroup");
+    exit(0);
+}
+
+/*
+ * run_level - Run nsessions sessions at once and print one line of
+ *     results. Each session runs in its own process and leaves its
+ *     latencies in a shared mapping.
+ */
+void run_level(int nsessions)
+{
+    char *map;
+    struct result_t *res;
+    double *all, *worst, start, secs;
+    int i, j, n = 0, done = 0, errors = 0, pid;
+
+    map = mmap(NULL, RESULT_SIZE * nsessions, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    fflush(stdout);
+    start = now_us();
+    for (i = 0; i < nsessions; i++) {
+        if ((pid = fork()) < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            run_session(i, (struct result_t *) (map + RESULT_SIZE * i));
+            exit(0);
+        }
+    }
+    while (wait(NULL) > 0)
+        ;
+    secs = (now_us() - start) / 1e6;
+
+    /* Collect the latencies */
+    all = malloc(sizeof(double) * ncmds * nsessions);
+    worst = malloc(sizeof(double) * nsessions);
+    for (i = 0; i < nsessions; i++) {
+        res = (struct result_t *) (map + RESULT_SIZE * i);
+        for (j = 0; j < res->done; j++)
+            all[n + j] = res->latency[j];
+        worst[i] = percentile(all + n, res->done, 0.99);
+        n += res->done;
+        done += res->done;
+        errors += res->errors;
+    }
+
+    printf("%8d %8d %8.2f %10.0f %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+           nsessions, done, secs, done / secs,
+           percentile(all, n, 0.50) / 1000, percentile(all, n, 0.90) / 1000,
+           percentile(all, n, 0.99) / 1000, percentile(all, n, 1.0) / 1000,
+           percentile(worst, nsessions, 0.99) / 1000);
+    if (errors)
+        printf("%8s %d commands timed out or failed\n", "", errors);
+    fflush(stdout);
+
+    free(all);
+    free(worst);
+    munmap(map, RESULT_SIZE * nsessions);
+}
+
+/*
+ * run_session - Start a shell and drive it with ncmds random commands
+ */
+void run_session(int id, struct result_t *res)
+{
+    struct session_t s;
+    double start;
+    int i, r, kind, total = mix[0] + mix[1] + mix[2] + mix[3], counter = 0;
+
+    srand(seed * 7919 + id);
+    res->done = res->errors = 0;
+    if (session_start(&s) < 0) {
+        res->errors++;
+        return;
+    }
+
+    for (i = 0; i < ncmds; i++) {
+        r = rand() % total;
+        for (kind = 0; r >= mix[kind]; kind++)
+            r -= mix[kind];
+
+        start = now_us();
+        if ((r = run_command(&s, kind, &counter)) < 0) {
+            res->errors++;
+            break;
+        }
+        /* run_command returns the time it spent waiting for the job */
+        res->latency[res->done++] = now_us() - start - r;
+    }
+    session_end(&s);
+}
+
+/*
+ * run_command - Send one command of the given kind and wait for the
+ *     prompt. Returns the microseconds spent before the timed part, or
+ *     -1 if the shell did not answer.
+ */
+int run_command(struct session_t *s, int kind, int *counter)
+{
+    static char *builtins[] = {"jobs", "let n=n+1", "set", "maxjobs"};
+    char line[MAXBUF], *p;
+    double start = now_us(), waited;
+    int i, jid, sig;
+
+    switch (kind) {
+    case CMD_BUILTIN:
+        return send_line(s, builtins[(*counter)++ % 4]) < 0
+            || next_prompt(s) < 0 ? -1 : 0;
+
+    case CMD_FG:
+        return send_line(s, "/bin/true") < 0 || next_prompt(s) < 0 ? -1 : 0;
+
+    case CMD_BURST:
+        /* The prompts after the first commands are not timed */
+        for (i = 0; i < BURST; i++)
+            if (send_line(s, "/bin/true &") < 0 || next_prompt(s) < 0)
+                return -1;
+        return 0;
+
+    case CMD_SIGNAL:
+        /* Start a job and wait until it is running, like WAIT does */
+        if (send_line(s, "./myspin1") < 0)
+            return -1;
+        if (!readable(s->syncfd, timeout) || recv(s->syncfd, line, MAXBUF, 0) < 0)
+            return -1;
+        waited = now_us() - start;
+
+        /* Alternate ctrl-c and ctrl-z; a stopped job is resumed with fg */
+        sig = ((*counter)++ & 1) ? SIGTSTP : SIGINT;
+        kill(s->pid, sig);
+        if (next_prompt(s) < 0)
+            return -1;
+        if (sig == SIGTSTP) {
+            if ((p = strstr(s->out, "Job [")) == NULL || sscanf(p, "Job [%d]", &jid) != 1)
+                return -1;
+            sprintf(line, "fg %%%d", jid);
+            if (send_line(s, line) < 0)
+                return -1;
+            send(s->syncfd, "signal", 6, 0); /* let myspin1 exit */
+            if (next_prompt(s) < 0)
+                return -1;
+        }
+        return waited;
+    }
+    return -1;
+}
+
+/*
+ * session_start - Fork a shell connected to a new socket pair, with its
+ *     own SYNCFD socket pair for its jobs
+ */
+int session_start(struct session_t *s)
+{
+    int datafd[2], syncfd[2];
+    char env[32], *shellargv[2];
+
+    if (socketpair(AF_LOCAL, SOCK_DGRAM, 0, datafd) < 0
+        || socketpair(AF_LOCAL, SOCK_DGRAM, 0, syncfd) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    sprintf(env, "SYNCFD=%d", syncfd[1]);
+    if ((s->pid = fork()) < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (s->pid == 0) {
+        /* Child code runs a shell */
+        close(datafd[0]);
+        close(syncfd[0]);
+        dup2(datafd[1], 0);
+        dup2(datafd[1], 1);
+        putenv(env);
+        cgroup_join();
+        shellargv[0] = shellprog;
+        shellargv[1] = NULL;
+        execve(shellprog, shellargv, environ);
+        perror("execve");
+        exit(1);
+    }
+    close(datafd[1]);
+    close(syncfd[1]);
+    s->datafd = datafd[0];
+    s->syncfd = syncfd[0];
+
+    /* Read the initial prompt */
+    return next_prompt(s);
+}
+
+/*
+ * session_end - Send EOF to the shell and reap it
+ */
+void session_end(struct session_t *s)
+{
+    send(s->datafd, "", 0, 0);
+    if (!readable(s->datafd, timeout))
+        kill(s->pid, SIGKILL);
+    waitpid(s->pid, NULL, 0);
+    close(s->datafd);
+    close(s->syncfd);
+}
+
+/*
+ * send_line - Send a command line to the shell
+ */
+int send_line(struct session_t *s, char *line)
+{
+    char buf[MAXBUF];
+
+    if (verbose > 1)
+        printf("tshload %d: sending '%s'\n", (int) getpid(), line);
+    snprintf(buf, MAXBUF, "%s\n", line);
+    if (send(s->datafd, buf, strlen(buf), 0) < 0) {
+        perror("send datafd");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * next_prompt - Collect the shell's output until the next prompt.
+ *     Returns 0, or -1 on EOF or timeout.
+ */
+int next_prompt(struct session_t *s)
+{
+    char buf[MAXBUF];
+    int n;
+
+    s->outlen = 0;
+    s->out[0] = '\0';
+    while (1) {
+        if (!readable(s->datafd, timeout)) {
+            if (verbose)
+                printf("tshload: shell %d timed out\n", s->pid);
+            return -1;
+        }
+        if ((n = recv(s->datafd, buf, MAXBUF - 1, 0)) <= 0)
+            return -1;
+        buf[n] = '\0';
+        if (!strcmp(buf, PROMPT))
+            return 0;
+        if (s->outlen + n < MAXBUF) {
+            memcpy(s->out + s->outlen, buf, n + 1);
+            s->outlen += n;
+        }
+    }
+}
+
+/*
+ * cgroup_setup - Create a cgroup limited to percent of one CPU for the
+ *     shells. Needs a writable cgroup v2 hierarchy with the cpu
+ *     controller enabled.
+ */
+int cgroup_setup(int percent)
+{
+    char path[MAXBUF + 32], buf[64];
+    int fd, n;
+
+    snprintf(cgroup, MAXBUF, "/sys/fs/cgroup/tshload.%d", (int) getpid());
+    if (mkdir(cgroup, 0755) < 0) {
+        perror(cgroup);
+        cgroup[0] = '\0';
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/cpu.max", cgroup);
+    n = sprintf(buf, "%d 100000\n", percent * 1000);
+    if ((fd = open(path, O_WRONLY)) < 0 || write(fd, buf, n) != n) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        rmdir(cgroup);
+        cgroup[0] = '\0';
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * cgroup_join - Move the calling process into the shells' cgroup
+ */
+void cgroup_join(void)
+{
+    char path[MAXBUF + 32], buf[32];
+    int fd, n;
+
+    if (cgroup[0] == '\0')
+        return;
+    snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup);
+    n = sprintf(buf, "%d\n", (int) getpid());
+    if ((fd = open(path, O_WRONLY)) < 0 || write(fd, buf, n) != n)
+        perror(path);
+    if (fd >= 0)
+        close(fd);
+}
+
+/*
+ * usage - Print help message and terminate
+ */
+void usage(char *msg)
+{
+    printf("%s\n", msg);
+    printf("Usage: tshload [-hV] [-s <shell>] [-n <n1,n2,...>] [-c <cmds>] [-m <mix>]\n");
+    printf("               [-r <seed>] [-t <secs>] [-C <percent>]\n");
+    printf("Options:\n");
+    printf("  -h            Print this message\n");
+    printf("  -V            Be more verbose\n");
+    printf("  -s <shell>    Shell program to test (default ./tshfast)\n");
+    printf("  -n <list>     Numbers of concurrent sessions (default 1,10,100)\n");
+    printf("  -c <cmds>     Commands per session (default 200)\n");
+    printf("  -m <mix>      Weights of builtins, foreground commands,\n");
+    printf("                background bursts and signals (default 40,40,10,10)\n");
+    printf("  -r <seed>     Random seed (default 1)\n");
+    printf("  -t <secs>     Seconds to wait for a prompt (default 10)\n");
+    printf("  -C <percent>  Run the shells in a cgroup capped at percent of a CPU\n");
+    exit(0);
+}
+
+/*
+ * now_us - Monotonic time in microseconds
+ */
+double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * readable - Wait secs seconds for descriptor fd to become readable
+ *            Return > 0 if fd is readable, 0 if timeout.
+ */
+int readable(int fd, double secs)
+{
+    int n;
+    fd_set rset;
+    struct timeval tv;
+
+    FD_ZERO(&rset);
+    FD_SET(fd, &rset);
+    tv.tv_sec = (long) secs;
+    tv.tv_usec = 0;
+    while ((n = select(fd+1, &rset, NULL, NULL, &tv)) < 0 && errno == EINTR)
+        ;
+    if (n < 0) {
+        perror("select");
+        exit(1);
+    }
+    return n;
+}
+
+/*
+ * percentile - The p-th quantile of n values, which it sorts
+ */
+double percentile(double *v, int n, double p)
+{
+    int i;
+
+    if (n == 0)
+        return 0;
+    qsort(v, n, sizeof(double), cmp_double);
+    i = (int) (p * n);
+    return v[i < n ? i : n - 1];
+}
+
+int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}